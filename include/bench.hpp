@@ -0,0 +1,7 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+int runBenchmarks();
+int runResumeCheck();
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <vector>
+
+#include "config.hpp"
+#include "fractalWindow.hpp"
+
+#define CHECKPOINT_MAGIC 0x4b434442 // "BDCK"
+#define CHECKPOINT_VERSION 3
+#define DUMP_MAGIC 0x504d4442 // "BDMP"
+
+// What wrote the random state sections, they mean something else in every mode
+enum CheckpointRng {
+    CHECKPOINT_RNG_PCG,
+    CHECKPOINT_RNG_COUNTER, // Key and launch counter in the first slots
+};
+
+enum CheckpointEngine {
+    CHECKPOINT_ENGINE_OPENCL,
+    CHECKPOINT_ENGINE_CPU,
+};
+
+/**
+ * Everything needed to continue a render exactly where it stopped. The
+ * header is followed by the sections in the order of the struct below,
+ * their sizes follow from the header.
+ */
+typedef struct CheckpointHeader {
+    uint32_t magic, version;
+    ViewSettings view;
+    uint32_t width, height;
+    uint32_t thresholdCount;
+    uint32_t thresholds[5];
+    char mandelName[32];
+    uint32_t particleCount;
+    uint32_t iterCount;
+    uint64_t stepCount;
+    uint32_t rngMode, engine;
+} CheckpointHeader;
+
+typedef struct Checkpoint {
+    CheckpointHeader header;
+    std::vector<uint32_t> count;
+    std::vector<Particle> particles;
+    std::vector<uint64_t> randomState;
+    std::vector<uint64_t> randomIncrement;
+} Checkpoint;
+
+void allocateCheckpoint(Checkpoint &checkpoint, Config *config);
+void setHeaderMode(CheckpointHeader &header, Config *config);
+bool matchesConfig(CheckpointHeader &header, Config *config);
+bool writeCheckpoint(const char *filename, Checkpoint &checkpoint);
+bool readCheckpoint(const char *filename, Checkpoint &checkpoint);
+
+/**
+ * A dump is a checkpoint header with DUMP_MAGIC followed by only the count
+ * section, small enough to collect from many independent runs.
+ */
+bool matchesDump(CheckpointHeader &header, CheckpointHeader &other);
+bool writeDump(const char *filename, Checkpoint &checkpoint);
+bool readDump(const char *filename, Checkpoint &checkpoint);
+
+#endif
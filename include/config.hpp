@@ -21,8 +21,10 @@ public:
 
     unsigned int width = 1080;
     unsigned int height = 720;
-    unsigned int maximum_size = 32;
     unsigned int frame_steps = 100;
+    float target_frame_ms = 0;
+    float headless_frame_ms = 0;
+    unsigned int output_bits = 8;
 
     float scale = 1.3;
     float center_x = -0.5;
@@ -31,6 +33,51 @@ public:
 
     bool profile = true;
     bool verbose = true;
+    bool telemetry = false;
+    std::string telemetry_file = "telemetry.csv";
+
+    bool replay_path = false;
+    unsigned int unroll = 5;
+    bool program_cache = true;
+    bool persistent_threads = false;
+    unsigned int seed = 0;
+    bool counter_rng = false;
+    bool cycle_detection = true;
+    float cycle_tolerance = 0;
+    unsigned int sample_grid = 0;
+    bool importance_map = true;
+    unsigned int importance_interval = 16;
+    bool cross_pollinate = false;
+    bool deterministic = false;
+    unsigned int persistent_groups = 0;
+
+    unsigned int path_type = 0;
+    unsigned int score_type = 0;
+
+    bool headless = false;
+    unsigned int headless_steps = 0;
+    float headless_seconds = 0;
+    unsigned int headless_samples = 0;
+    std::string dump_file = "";
+    unsigned int tiles_x = 1;
+    unsigned int tiles_y = 1;
+
+    bool local_histogram = false;
+
+    bool bench = false;
+    unsigned int bench_steps = 20;
+    unsigned int bench_converge = 1;
+    unsigned int bench_converge_steps = 200;
+    std::string bench_output = "bench.json";
+    bool use_gpu = true;
+
+    std::string checkpoint_file = "checkpoint.bin";
+    float checkpoint_interval = 0;
+    bool resume = false;
+
+    bool cpu_engine = false;
+    unsigned int thread_count = 0;
+    bool cpu_simd = true;
 
     float alpha = 0.8;
 
@@ -62,10 +109,57 @@ private:
         {"center_y", {'f', (void *)&center_y}},
         {"theta", {'f', (void *)&theta}},
         
-        {"maximum_size", {'i', (void *)&maximum_size}},
         {"frame_steps", {'i', (void *)&frame_steps}},
+        {"target_frame_ms", {'f', (void *)&target_frame_ms}},
+        {"headless_frame_ms", {'f', (void *)&headless_frame_ms}},
+        {"output_bits", {'i', (void *)&output_bits}},
         {"profile", {'b', (void *)&profile}},
         {"verbose", {'b', (void *)&verbose}},
+        {"telemetry", {'b', (void *)&telemetry}},
+        {"telemetry_file", {'s', (void *)&telemetry_file}},
+
+        {"replay_path", {'b', (void *)&replay_path}},
+        {"unroll", {'i', (void *)&unroll}},
+        {"program_cache", {'b', (void *)&program_cache}},
+        {"persistent_threads", {'b', (void *)&persistent_threads}},
+        {"seed", {'i', (void *)&seed}},
+        {"counter_rng", {'b', (void *)&counter_rng}},
+        {"cycle_detection", {'b', (void *)&cycle_detection}},
+        {"cycle_tolerance", {'f', (void *)&cycle_tolerance}},
+        {"sample_grid", {'i', (void *)&sample_grid}},
+        {"importance_map", {'b', (void *)&importance_map}},
+        {"importance_interval", {'i', (void *)&importance_interval}},
+        {"cross_pollinate", {'b', (void *)&cross_pollinate}},
+        {"deterministic", {'b', (void *)&deterministic}},
+        {"persistent_groups", {'i', (void *)&persistent_groups}},
+
+        {"path_type", {'i', (void *)&path_type}},
+        {"score_type", {'i', (void *)&score_type}},
+
+        {"headless", {'b', (void *)&headless}},
+        {"headless_steps", {'i', (void *)&headless_steps}},
+        {"headless_seconds", {'f', (void *)&headless_seconds}},
+        {"headless_samples", {'i', (void *)&headless_samples}},
+        {"dump_file", {'s', (void *)&dump_file}},
+        {"tiles_x", {'i', (void *)&tiles_x}},
+        {"tiles_y", {'i', (void *)&tiles_y}},
+
+        {"local_histogram", {'b', (void *)&local_histogram}},
+
+        {"bench", {'b', (void *)&bench}},
+        {"bench_steps", {'i', (void *)&bench_steps}},
+        {"bench_converge", {'i', (void *)&bench_converge}},
+        {"bench_converge_steps", {'i', (void *)&bench_converge_steps}},
+        {"bench_output", {'s', (void *)&bench_output}},
+        {"use_gpu", {'b', (void *)&use_gpu}},
+
+        {"checkpoint_file", {'s', (void *)&checkpoint_file}},
+        {"checkpoint_interval", {'f', (void *)&checkpoint_interval}},
+        {"resume", {'b', (void *)&resume}},
+
+        {"cpu_engine", {'b', (void *)&cpu_engine}},
+        {"thread_count", {'i', (void *)&thread_count}},
+        {"cpu_simd", {'b', (void *)&cpu_simd}},
         
         {"alpha", {'f', (void *)&alpha}},
     };
@@ -20,11 +20,31 @@ struct FractalCoordinate {
     void rotate(float sinTheta, float cosTheta);
 };
 
-FractalCoordinate complex_mul(FractalCoordinate f1, FractalCoordinate f2);
-FractalCoordinate complex_square(FractalCoordinate f);
-FractalCoordinate operator+(FractalCoordinate f1, FractalCoordinate f2);
-FractalCoordinate operator*(float x, FractalCoordinate f);
-FractalCoordinate operator*(FractalCoordinate f, float x);
+// Inlined since the CPU engine calls these in its innermost loop
+
+inline FractalCoordinate complex_mul(FractalCoordinate f1, FractalCoordinate f2) {
+    return {f1.x * f2.x - f1.y * f2.y, f1.x * f2.y + f1.y * f2.x};
+}
+
+inline FractalCoordinate complex_square(FractalCoordinate f) {
+    return {f.x * f.x - f.y * f.y, 2 * f.x * f.y};
+}
+
+inline float complex_norm2(FractalCoordinate f) {
+    return f.x * f.x + f.y * f.y;
+}
+
+inline FractalCoordinate operator+(FractalCoordinate f1, FractalCoordinate f2) {
+    return {f1.x + f2.x, f1.y + f2.y};
+}
+
+inline FractalCoordinate operator*(float x, FractalCoordinate f) {
+    return {x * f.x, x * f.y};
+}
+
+inline FractalCoordinate operator*(FractalCoordinate f, float x) {
+    return {x * f.x, x * f.y};
+}
 
 /**
  * Coordinates in the pixel array that is drawn to the screen.
@@ -0,0 +1,122 @@
+#ifndef CPU_ENGINE_H
+#define CPU_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+#include "cpuSimd.hpp"
+#include "fractalWindow.hpp"
+#include "pcg.hpp"
+
+typedef struct CpuParticle CpuParticle;
+
+// Where getNewPos draws candidates from
+typedef struct Sampler {
+    const SimdKernels *simd; // Tests the candidates in batches when set
+    const uint32_t *cells; // See buildSampleCells, NULL uses the whole sampling rectangle
+    unsigned int gridSize;
+
+    // Sections of the importance map after the table, NULL without one, see createImportanceMap
+    const uint32_t *density;
+    uint32_t *scores;
+} Sampler;
+
+// Must match POOL_SIZE in buddha.cl
+#define POOL_SIZE 1024
+
+// Best accepted state of particles i, i + POOL_SIZE, ..., see updatePool in shaders/buddha.cl
+typedef struct PoolEntry {
+    FractalCoordinate offset;
+    unsigned int iterCount;
+    float score;
+} PoolEntry;
+
+// Counted per worker and added to the shared totals once per range
+typedef struct StepCounts {
+    uint64_t iterations, samples, saved;
+} StepCounts;
+
+// Brent's cycle detection state of one particle, see cycleFound in shaders/buddha.cl
+typedef struct CycleState {
+    FractalCoordinate offset, ref;
+    unsigned int power, length;
+} CycleState;
+
+/**
+ * Native implementation of the mandelStep kernels in shaders/buddha.cl.
+ *
+ * Particles are split into contiguous slices, one per worker thread. The
+ * workers are started once and keep the same slice for every call. Each
+ * particle carries its own PCG stream, so the only state shared between
+ * workers is the count histogram, which is updated with relaxed atomics.
+ * Orbits are replayed from the particle offset instead of being stored,
+ * so memory use does not scale with the thresholds. With cpu_simd the
+ * escape loop runs on AVX2 or AVX-512 lanes, see cpuSimd.hpp.
+ */
+class CpuEngine {
+public:
+    CpuEngine(Config *config, unsigned int threadCount = 0);
+    ~CpuEngine();
+
+    void seed();
+    void setSampleCells(const std::vector<uint32_t> &cells);
+    void setView(ViewSettings view);
+    void resetCount();
+    void resetStats();
+    void initParticles();
+    void updatePool();
+    void step(int pathType, int scoreType, int count = 1);
+    void updateDiff(float alpha);
+    void findMax(bool diff, uint32_t *maximum);
+    void renderImage(bool diff, uint32_t *maximum, uint32_t *image);
+    void readParticles(Particle *target);
+
+    unsigned int threadCount;
+    unsigned int pixelCount;
+
+    std::vector<uint32_t> count, prevCount, countDiff;
+    // Copy of count at the start of the step, only used in deterministic mode
+    std::vector<uint32_t> snapshot;
+    std::vector<Particle> particles;
+    std::vector<pcg32_random_t> randomState;
+
+    // Same counters as BENCH_STATS in the kernel, always on since they are cheap here
+    std::atomic<uint64_t> iterationCount, sampleCount, savedCount;
+
+    // NULL runs the scalar loop
+    const SimdKernels *simd = NULL;
+    Sampler sampler;
+    std::vector<uint32_t> sampleCells;
+
+    // Jumps may land near the pool entries when set
+    bool crossPollinate = false;
+    std::vector<PoolEntry> pool;
+
+private:
+    void runWorkers(size_t size, std::function<void(size_t, size_t)> work);
+    void workerLoop(unsigned int index);
+    void stepRange(size_t begin, size_t end, int pathType, int scoreType);
+    void stepParticle(size_t x, int pathType, int scoreType, StepCounts &counts);
+    void stepLanes(size_t begin, size_t end, int pathType, int scoreType, StepCounts &counts);
+    bool updateParticle(CpuParticle &tmp, CycleState &cycle, pcg32_random_t *rng, int pathType, int scoreType, uint64_t &saved);
+
+    Config *config;
+    ViewSettings view;
+
+    // The job runWorkers hands out, guarded by workerMutex
+    std::vector<std::thread> workers;
+    std::mutex workerMutex;
+    std::condition_variable workerWake, workerDone;
+    std::function<void(size_t, size_t)> job;
+    size_t jobSize = 0;
+    uint64_t jobGeneration = 0;
+    unsigned int jobsLeft = 0;
+    bool stopping = false;
+};
+
+#endif
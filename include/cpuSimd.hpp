@@ -0,0 +1,73 @@
+#ifndef CPU_SIMD_H
+#define CPU_SIMD_H
+
+#include <cstdint>
+
+#include "coordinates.hpp"
+
+#define SIMD_MAX_WIDTH 16
+
+/**
+ * Mirrors of the bulb constants in shaders/buddha.cl, used by isValid
+ */
+
+const float RADIUS_1 = 0.0937;
+const float RADIUS_3 = 0.0435;
+const float RADIUS_4 = 0.0385;
+const float RADIUS_5 = 0.023;
+
+const FractalCoordinate CENTER_1 = {-0.1251, 0.744};
+const FractalCoordinate CENTER_2 = {-1.309, 0};
+const FractalCoordinate CENTER_3 = {0.2815, 0.531};
+const FractalCoordinate CENTER_4 = {-0.5045, 0.563};
+const FractalCoordinate CENTER_5 = {0.379, 0.336};
+
+/**
+ * One group of particles in structure of arrays form, padded to the widest
+ * vector. Lanes past the group size sit at the origin, which never escapes,
+ * and are left out of active. The cycle fields hold the CycleState of each
+ * lane, see cycleFound in cpuEngine.cpp.
+ */
+typedef struct SimdLanes {
+    alignas(64) float posX[SIMD_MAX_WIDTH];
+    alignas(64) float posY[SIMD_MAX_WIDTH];
+    alignas(64) float offsetX[SIMD_MAX_WIDTH];
+    alignas(64) float offsetY[SIMD_MAX_WIDTH];
+    alignas(64) int32_t iterCount[SIMD_MAX_WIDTH];
+    alignas(64) int32_t iterLimit[SIMD_MAX_WIDTH]; // iterCount at which the lane needs the scalar code
+
+    alignas(64) float cycleOffsetX[SIMD_MAX_WIDTH];
+    alignas(64) float cycleOffsetY[SIMD_MAX_WIDTH];
+    alignas(64) float cycleRefX[SIMD_MAX_WIDTH];
+    alignas(64) float cycleRefY[SIMD_MAX_WIDTH];
+    alignas(64) int32_t cyclePower[SIMD_MAX_WIDTH];
+    alignas(64) int32_t cycleLength[SIMD_MAX_WIDTH];
+
+    uint32_t active;
+} SimdLanes;
+
+/**
+ * Vectorized versions of the two hot loops of the CPU engine, with the
+ * same float operations in the same order as the scalar code so both give
+ * bit identical results.
+ */
+typedef struct SimdKernels {
+    const char *name;
+    unsigned int width;
+
+    // Runs rounds of substeps on every lane until a lane escapes, reaches
+    // its iterLimit or closes a cycle within tolerance, or maxSteps rounds
+    // are done. Returns the number of rounds, events gets a bit for each
+    // lane that stopped the loop. Those lanes keep their cycle state from
+    // before the last round, since the scalar code redoes that check.
+    // A negative tolerance never matches.
+    unsigned int (*iterate)(SimdLanes &lanes, unsigned int substeps, unsigned int maxSteps, float tolerance, uint32_t *events);
+
+    // Bit per candidate that passes isValid, x and y hold width candidates
+    uint32_t (*valid)(const float *x, const float *y);
+} SimdKernels;
+
+// Widest variant the CPU supports, NULL when there is none
+const SimdKernels *getSimdKernels();
+
+#endif
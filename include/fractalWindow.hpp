@@ -5,12 +5,14 @@
 
 #include "config.hpp"
 #include "opencl.hpp"
+#include "telemetry.hpp"
 
 typedef struct Particle {
     cl_float2 pos;
     cl_float2 offset, prevOffset;
     unsigned int iterCount, bestIter;
     float score, prevScore;
+    float proposalRatio;
 } Particle;
 
 enum PathOptions {
@@ -64,7 +66,9 @@ void destroyFractalWindow();
 extern ViewSettings viewFW, defaultView;
 extern WindowSettings settingsFW;
 extern uint32_t *pixelsFW;
+extern uint32_t *mappedPixels;
 extern OpenCl *opencl;
+extern Telemetry *telemetry;
 extern Config *config;
 extern uint32_t *maximumCounts;
 extern GLFWwindow *windowFW;
@@ -74,7 +78,22 @@ extern uint32_t prevMax;
 extern float frameTime;
 extern uint32_t iterCount;
 extern uint64_t stepCount;
+extern unsigned int frameSteps;
 
 extern std::vector<std::string> getMandelNames();
+extern void resetCounts();
+extern void resetParticles();
+extern void applyView();
+extern void fetchParticles(Particle *particles);
+extern void fetchCounts(uint32_t *counts);
+extern void stepMandel(int count);
+extern void finishSteps();
+extern void resetStats();
+extern void fetchStats(uint64_t *iterations, uint64_t *samples, uint64_t *saved);
+extern void renderHeadless();
+extern void prepare();
+extern void releaseBackend();
+extern void saveCheckpoint();
+extern bool resumeCheckpoint();
 
 #endif
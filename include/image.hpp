@@ -0,0 +1,101 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#include "fractalWindow.hpp"
+
+/**
+ * Mirrors of the colour constants in shaders/buddha.cl
+ */
+
+const float COLOR_SCHEME[3][3] = {
+    {0.2, 0.0, 0.4,},
+    {0.0, 0.4, 0.6,},
+    {0.8, 0.6, 0.0,},
+};
+
+const unsigned int COLOR_COUNT = 3;
+const double IMAGE_MAX = 4294967295.0;
+
+/**
+ * Bytes per pixel of each output_bits setting: packed RGBA8, RGBA16 with
+ * big-endian channels as PNG stores them, or the original 32-bit RGB.
+ */
+inline size_t getImageSize(unsigned int outputBits, size_t pixelCount) {
+    switch (outputBits) {
+        case 8:
+            return 4 * pixelCount;
+        case 16:
+            return 8 * pixelCount;
+        default:
+            return 3 * sizeof(uint32_t) * pixelCount;
+    }
+}
+
+inline uint16_t swapBytes(uint16_t value) {
+    return (value >> 8) | (value << 8);
+}
+
+/**
+ * Same colour mapping as the renderImage kernel, for pixels [begin, end).
+ * Templated on the count type so merged histograms can be rendered from
+ * 64-bit sums without clamping them first.
+ */
+template <typename T>
+inline void renderCounts(const T *count, const T *maximum, uint32_t thresholdCount, uint32_t pixelCount, void *image, size_t begin, size_t end, unsigned int outputBits = 32) {
+    const unsigned int colorCount = std::min(thresholdCount, COLOR_COUNT);
+
+    for (size_t pixel = begin; pixel < end; pixel++) {
+        if (outputBits == 32) {
+            for (unsigned int j = 0; j < 3; j++) {
+                double value = 0;
+
+                for (unsigned int i = 0; i < colorCount; i++) {
+                    float countFraction = (float)count[(size_t)i * pixelCount + pixel] / (float)(maximum[i] + 1);
+                    value += (uint32_t)(COLOR_SCHEME[i][j] * sqrt(countFraction) * IMAGE_MAX);
+                }
+
+                ((uint32_t *)image)[3 * pixel + j] = std::min(value, IMAGE_MAX);
+            }
+
+            continue;
+        }
+
+        float color[3] = {0, 0, 0};
+
+        for (unsigned int i = 0; i < colorCount; i++) {
+            float countFraction = sqrt((float)count[(size_t)i * pixelCount + pixel] / (float)(maximum[i] + 1));
+
+            for (unsigned int j = 0; j < 3; j++) {
+                color[j] += COLOR_SCHEME[i][j] * countFraction;
+            }
+        }
+
+        for (unsigned int j = 0; j < 3; j++) {
+            color[j] = std::min(color[j], 1.f);
+
+            if (outputBits == 8) {
+                ((uint8_t *)image)[4 * pixel + j] = color[j] * 255;
+            } else {
+                ((uint16_t *)image)[4 * pixel + j] = swapBytes(color[j] * 65535);
+            }
+        }
+
+        if (outputBits == 8) {
+            ((uint8_t *)image)[4 * pixel + 3] = 255;
+        } else {
+            ((uint16_t *)image)[4 * pixel + 3] = 65535;
+        }
+    }
+}
+
+std::string getPngFilename(std::string mandelName, ViewSettings view);
+void copyRgb8(uint32_t *pixels, uint32_t width, uint32_t height, unsigned char *target, uint32_t targetWidth, uint32_t targetHeight, uint32_t x0, uint32_t y0);
+void writePngRgb8(const char *filename, unsigned char *pixels, uint32_t width, uint32_t height);
+void writePng(const char *filename, void *pixels, uint32_t width, uint32_t height, unsigned int outputBits = 32);
+
+#endif
@@ -10,7 +10,6 @@
 #include <CL/cl.h>
 #endif
 
-#include <chrono>
 #include <map>
 #include <string>
 #include <vector>
@@ -18,6 +17,7 @@
 typedef struct OpenClBuffer {
     cl_mem buffer;
     size_t size;
+    cl_mem_flags flags; // Added to CL_MEM_READ_WRITE, e.g. CL_MEM_ALLOC_HOST_PTR
 } OpenClBuffer;
 
 typedef struct BufferSpec {
@@ -38,6 +38,17 @@ typedef struct KernelSpec {
     OpenClKernel kernel;
 } KernelSpec;
 
+typedef struct KernelEvent {
+    std::string name;
+    cl_event event;
+} KernelEvent;
+
+typedef struct KernelTime {
+    std::string name;
+    float time;
+    unsigned int launches;
+} KernelTime;
+
 class OpenCl {
 public:
     OpenCl(
@@ -46,9 +57,17 @@ public:
         std::vector<KernelSpec> kernelArgs,
         bool profile = false,
         bool useGpu = true,
-        bool verbose = true
+        bool verbose = true,
+        std::string buildOptions = "",
+        std::string cacheDir = ""
     );
     void prepare(std::vector<BufferSpec> bufferArgs, std::vector<KernelSpec> kernelArgs);
+    cl_program buildProgram(std::string options);
+    cl_program loadCachedProgram(std::string cacheFile, std::string options);
+    void saveCachedProgram(std::string cacheFile, cl_program program);
+    std::string getCacheFile(std::string options);
+    void createKernel(KernelSpec kernelSpec, std::string options);
+    bool hasKernel(std::string name);
     void setDevice();
     void getPlatformIds();
     void setKernelArg(std::string kernelName, cl_uint arg_index, size_t size, void *pointer);
@@ -56,27 +75,35 @@ public:
     void writeBuffer(std::string name, void *pointer);
     void step(std::string name, int count = 1);
     void readBuffer(std::string name, void *pointer);
+    void readBufferAsync(std::string name, void *pointer, cl_event *event);
+    void copyBuffer(std::string source, std::string target);
+    void *mapBufferAsync(std::string name, cl_map_flags flags, cl_event *event);
+    void unmapBuffer(std::string name, void *pointer);
     void cleanup();
     void flush();
+    void finish();
     void printDeviceTypes();
     void getDeviceIds(cl_platform_id platformId);
 
-    void startTimer();
-    void getTime();
-    void startFrame();
+    void endFrame();
 
     cl_platform_id *platform_ids;
     cl_platform_id platform_id;
     
     cl_device_id *device_ids;
     cl_device_id device_id;
+    cl_uint compute_units;
 
     cl_context context;
     cl_command_queue command_queue;
 
-    cl_event timer_event;
+    // Events of the kernels enqueued since the last endFrame, only recorded when profiling
+    std::vector<KernelEvent> frameEvents;
+    std::vector<KernelTime> kernelTimes;
 
     cl_program program;
+    // Every program built so far, keyed by the extra build options
+    std::map<std::string, cl_program> programs;
     std::map<std::string, OpenClKernel> kernels;
     std::map<std::string, OpenClBuffer> buffers;
     cl_uint ret_num_devices;
@@ -87,14 +114,13 @@ public:
     char *source_str;
 
     char *filename;
+    std::string build_options;
+    // Built programs are stored here, empty disables the cache
+    std::string cache_dir;
+    std::string device_key;
     bool use_gpu;
     bool profile;
     bool verbose;
-
-    std::chrono::high_resolution_clock::time_point startingTime;
-
-    float chronoTime = 0, clTime = 0;
-    unsigned printCount = 0;
 };
 
 
@@ -100,6 +100,7 @@ uint32_t pcg32_boundedrand_r(pcg32_random_t* rng, uint32_t bound);
 double UNI();
 double UNI_r(pcg32_random_t* rng);
 double RANDN();
+double RANDN_r(pcg32_random_t* rng);
 
 #if __cplusplus
 }
@@ -0,0 +1,51 @@
+#ifndef SAMPLE_GRID_H
+#define SAMPLE_GRID_H
+
+#include <cstdint>
+#include <vector>
+
+// Mirrored in shaders/buddha.cl, the grid covers [-2, 2] x [-2, 2]
+#define SAMPLE_GRID_MIN -2.f
+#define SAMPLE_GRID_RANGE 4.f
+
+// Orbits tested along each cell edge, the corners included once
+#define SAMPLE_EDGE_POINTS 8
+
+/**
+ * The cells of a gridSize x gridSize grid over the c-plane that getNewPos
+ * draws new offsets from. Since the Mandelbrot set is full, a cell whose
+ * whole border stays bounded lies inside the set and can never produce an
+ * escaping orbit. The border is only sampled at SAMPLE_EDGE_POINTS orbits
+ * per edge, so this is a heuristic: an exterior channel can pass between
+ * two sample points. A cell is only dropped when it and all 8 neighbours
+ * look interior, which keeps the cells such a channel runs through as
+ * long as it surfaces on a neighbouring border. Cells outside |c| < 2 are
+ * dropped as well.
+ *
+ * The first element holds the number of cells, followed by their indices
+ * y * gridSize + x.
+ */
+std::vector<uint32_t> buildSampleCells(unsigned int gridSize, unsigned int maxLength, unsigned int threadCount = 0);
+
+// Mirrored in shaders/buddha.cl, table entries per cell on average
+#define SAMPLE_TABLE_SCALE 4
+
+// Share of the learned scores kept at every rebuild of the table
+#define IMPORTANCE_DECAY 0.5f
+
+/**
+ * Importance map on top of the cells from buildSampleCells, laid out as
+ * [tableSize, table..., density[gridSize^2], scores[gridSize^2]]. The table
+ * holds SAMPLE_TABLE_SCALE entries per cell, every cell at least once and
+ * the rest spread by score, so drawing a uniform entry samples the inverse
+ * CDF of the scores mixed with a uniform floor. density holds the number of
+ * entries of each cell, SAMPLE_TABLE_SCALE for cells that aren't listed.
+ * The kernels add the score of every orbit to the cell of its offset in
+ * scores, stored as float bits.
+ */
+std::vector<uint32_t> createImportanceMap(const std::vector<uint32_t> &cells, unsigned int gridSize);
+
+// Rebuilds the table and density from the scores and decays them
+void updateImportanceMap(std::vector<uint32_t> &map, const std::vector<uint32_t> &cells, unsigned int gridSize);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "opencl.hpp"
+
+#define TELEMETRY_FRAMES 512
+#define TELEMETRY_KERNELS 16
+#define TELEMETRY_THRESHOLDS 5
+
+typedef struct TelemetryFrame {
+    uint32_t frame;
+    float frameTime; // ms
+    uint64_t samples; // Added during this frame
+    float maximumCounts[TELEMETRY_THRESHOLDS];
+    float kernelTimes[TELEMETRY_KERNELS]; // μs, indexed like Telemetry::kernelNames
+} TelemetryFrame;
+
+/**
+ * Ring buffer of the last TELEMETRY_FRAMES frames. Recording copies a few
+ * numbers into a preallocated slot, kernels beyond TELEMETRY_KERNELS
+ * distinct names are not tracked.
+ */
+class Telemetry {
+public:
+    Telemetry(unsigned int thresholdCount);
+    void record(uint32_t frame, float frameTime, uint64_t samples, uint32_t *maximumCounts, std::vector<KernelTime> &kernelTimes);
+    void clear();
+    bool save(std::string filename);
+    bool saveCsv(const char *filename);
+    bool saveJson(const char *filename);
+
+    // Index of the oldest frame, for ImPlot's offset argument
+    unsigned int offset();
+
+    TelemetryFrame frames[TELEMETRY_FRAMES];
+    unsigned int frameCount = 0;
+    unsigned int head = 0;
+
+    std::vector<std::string> kernelNames;
+    unsigned int threshold_count;
+
+private:
+    int getKernelIndex(std::string &name);
+    TelemetryFrame &getFrame(unsigned int i);
+};
+
+#endif
@@ -75,9 +75,80 @@ inline float inverseNormalCdf(float u) {
 	}
 }
 
-inline ulong pcg32Random(global ulong *randomState, global ulong *randomIncrement, int x) {
-    ulong oldstate = randomState[x];
-    randomState[x] = oldstate * PCG_SHIFT + randomIncrement[x];
+/**
+ * Two generators behind the same helpers. The default is a PCG stream per
+ * particle in randomState/randomIncrement. With COUNTER_RNG, Philox4x32-10
+ * is keyed by the seed and particle and counts over the launch index and
+ * the draws within it, so there is no RNG state in global memory at all.
+ * Kernels take RNG_KERNEL_PARAMS, start every particle with RNG_INIT, pass
+ * RNG_ARGS to the helpers and finish it with RNG_STORE. Either way the state
+ * is a private variable, so it can stay in registers for the whole kernel.
+ */
+
+#ifdef COUNTER_RNG
+
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+
+typedef struct CounterRng {
+    uint4 counter; // Launch index, high seed word, draw block
+    uint2 key; // Particle, low seed word
+    uint block[4];
+    uint used;
+} CounterRng;
+
+inline uint4 philox4x32(uint4 counter, uint2 key) {
+    for (int i = 0; i < 10; i++) {
+        const uint hi0 = mul_hi((uint)PHILOX_M0, counter.x);
+        const uint hi1 = mul_hi((uint)PHILOX_M1, counter.z);
+
+        counter = (uint4)(hi1 ^ counter.y ^ key.x, PHILOX_M1 * counter.z, hi0 ^ counter.w ^ key.y, PHILOX_M0 * counter.x);
+        key += (uint2)(PHILOX_W0, PHILOX_W1);
+    }
+
+    return counter;
+}
+
+inline CounterRng newCounterRng(ulong seed, ulong launch, uint particle) {
+    CounterRng rng;
+
+    rng.counter = (uint4)((uint)launch, (uint)(launch >> 32), (uint)(seed >> 32), 0);
+    rng.key = (uint2)(particle, (uint)seed);
+    rng.used = 4;
+
+    return rng;
+}
+
+inline uint counterRandom(private CounterRng *rng) {
+    if (rng->used == 4) {
+        vstore4(philox4x32(rng->counter, rng->key), 0, rng->block);
+        rng->counter.w++;
+        rng->used = 0;
+    }
+
+    return rng->block[rng->used++];
+}
+
+#define RNG_KERNEL_PARAMS ulong rngSeed, ulong rngLaunch
+#define RNG_KERNEL_ARGS rngSeed, rngLaunch
+#define RNG_PARAMS private CounterRng *rng, int x
+#define RNG_ARGS rng, x
+#define RNG_INIT(particle) CounterRng rngState = newCounterRng(rngSeed, rngLaunch, particle); private CounterRng *rng = &rngState;
+#define RNG_STORE(particle)
+#define NEXT_RANDOM counterRandom(rng)
+
+#else
+
+typedef struct PcgRng {
+    ulong state;
+    ulong increment;
+} PcgRng;
+
+inline uint pcg32Random(private PcgRng *rng) {
+    ulong oldstate = rng->state;
+    rng->state = oldstate * PCG_SHIFT + rng->increment;
     uint xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
     uint rot = oldstate >> 59u;
     uint pcg = (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
@@ -93,36 +164,42 @@ __kernel void seedNoise(
 ) {
     const int x = get_global_id(0);
 
-    randomState[x] = 0U;
-    randomIncrement[x] = (initSeq[x] << 1u) | 1u;
-    pcg32Random(randomState, randomIncrement, x);
-    randomState[x] += initState[x];
-    pcg32Random(randomState, randomIncrement, x);
+    PcgRng rng = {0U, (initSeq[x] << 1u) | 1u};
+    pcg32Random(&rng);
+    rng.state += initState[x];
+    pcg32Random(&rng);
+
+    randomState[x] = rng.state;
+    randomIncrement[x] = rng.increment;
 }
 
+#define RNG_KERNEL_PARAMS global ulong *randomState, global ulong *randomIncrement
+#define RNG_KERNEL_ARGS randomState, randomIncrement
+#define RNG_PARAMS private PcgRng *rng, int x
+#define RNG_ARGS rng, x
+#define RNG_INIT(particle) PcgRng rngState = {randomState[particle], randomIncrement[particle]}; private PcgRng *rng = &rngState;
+#define RNG_STORE(particle) randomState[particle] = rngState.state;
+#define NEXT_RANDOM pcg32Random(rng)
+
+#endif
+
 inline float uniformRand(
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    int x
+    RNG_PARAMS
 ) {
-    return (float)pcg32Random(randomState, randomIncrement, x) / PCG_MAX_1;
+    return (float)NEXT_RANDOM / PCG_MAX_1;
 }
 
 inline unsigned int randint(
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    int x,
+    RNG_PARAMS,
     unsigned int maxVal
 ) {
-    return pcg32Random(randomState, randomIncrement, x) % maxVal;
+    return NEXT_RANDOM % maxVal;
 }
 
 inline float gaussianRand(
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    int x
+    RNG_PARAMS
 ) {
-    return inverseNormalCdf(uniformRand(randomState, randomIncrement, x));
+    return inverseNormalCdf(uniformRand(RNG_ARGS));
 }
 
 /**
@@ -160,6 +237,29 @@ typedef struct ViewSettings {
     int sizeX, sizeY;
 } ViewSettings;
 
+/**
+ * The host passes the image size and thresholds as build options, so they
+ * are compile time constants in the hot loop. Without them the kernels fall
+ * back to the runtime arguments.
+ */
+
+#ifdef IMAGE_WIDTH
+#define VIEW_SIZE_X IMAGE_WIDTH
+#define VIEW_SIZE_Y IMAGE_HEIGHT
+#else
+#define VIEW_SIZE_X view.sizeX
+#define VIEW_SIZE_Y view.sizeY
+#endif
+
+#ifdef THRESHOLDS
+constant unsigned int THRESHOLD_TABLE[THRESHOLD_COUNT] = {THRESHOLDS};
+#define THRESHOLD(i) THRESHOLD_TABLE[i]
+#define THRESHOLD_COUNT_VALUE THRESHOLD_COUNT
+#else
+#define THRESHOLD(i) threshold[i]
+#define THRESHOLD_COUNT_VALUE thresholdCount
+#endif
+
 inline float2 rotateCoords(float2 coords, ViewSettings view) {
     return (float2) {
         view.cosTheta * coords.x - view.sinTheta * coords.y,
@@ -183,8 +283,8 @@ inline float2 fractalToScreen(float2 fractalCoord, ViewSettings view) {
 
 inline int2 screenToPixel(float2 screenCoord, ViewSettings view) {
     return (int2) {
-        (1 + screenCoord.x) / 2 * view.sizeX,
-        (1 + screenCoord.y) / 2 * view.sizeY
+        (1 + screenCoord.x) / 2 * VIEW_SIZE_X,
+        (1 + screenCoord.y) / 2 * VIEW_SIZE_Y
     };
 }
 
@@ -201,14 +301,33 @@ typedef struct Particle {
     float2 offset, prevOffset;
     unsigned int iterCount, bestIter;
     float score, prevScore;
+    float proposalRatio; // q(prevOffset) / q(offset) of the move that proposed offset
 } Particle;
 
-__kernel void resetCount(global unsigned int *count, int size) {
-    const int x = get_global_id(0);
+/**
+ * Path storage. With REPLAY_PATH the orbit is never written to global memory,
+ * getScore and addPath recompute it from the particle offset instead.
+ */
 
-    for (int i = 0; i < size; i++) {
-        count[size * x + i] = 0;
-    }
+#ifdef REPLAY_PATH
+#define PATH_STORE(index, value)
+#else
+#define PATH_STORE(index, value) path[index] = value;
+#endif
+
+// Returns the next point of the orbit, z holds the replay state
+inline float2 nextPathPos(global float2 *path, unsigned int index, float2 *z, float2 offset) {
+#ifdef REPLAY_PATH
+    float2 pos = *z;
+    *z = csquare(*z) + offset;
+    return pos;
+#else
+    return path[index];
+#endif
+}
+
+__kernel void resetCount(global unsigned int *count) {
+    count[get_global_id(0)] = 0;
 }
 
 inline int matchThreshold(
@@ -216,8 +335,8 @@ inline int matchThreshold(
     global unsigned int *threshold,
     unsigned int thresholdCount
 ) {
-    for (uint i = 0; i < thresholdCount; i++) {
-        if (particle.iterCount <= threshold[i]) {
+    for (uint i = 0; i < THRESHOLD_COUNT_VALUE; i++) {
+        if (particle.iterCount <= THRESHOLD(i)) {
             return i;
         }
     }
@@ -281,25 +400,108 @@ inline bool isValid(float2 coord) {
     return true;
 }
 
-inline float2 getNewPos(
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    int x
+/**
+ * With SAMPLE_GRID candidates are drawn uniformly from the cells of a
+ * SAMPLE_GRID x SAMPLE_GRID grid over [-2, 2]^2 that the host found can
+ * produce escaping orbits, see buildSampleCells. sampleCells[0] holds the
+ * number of cells, followed by their indices. Without it the whole
+ * sampling rectangle is used and sampleCells is a dummy buffer.
+ *
+ * With IMPORTANCE_MAP, set to the table size, the list is replaced by a
+ * table in which cells appear once per share of the score their orbits
+ * earned, followed by the density (number of entries) of every grid cell
+ * and the scores the kernels add to, see createImportanceMap.
+ */
+
+#ifdef SAMPLE_GRID
+
+constant float SAMPLE_GRID_MIN = -2;
+constant float SAMPLE_CELL_SIZE = 4. / SAMPLE_GRID;
+
+inline float2 getCandidate(
+    RNG_PARAMS,
+    global const unsigned int *sampleCells
 ) {
-    float2 newOffset = (float2)(
-        (9. * uniformRand(randomState, randomIncrement, x) - 5.2),
-        (6. * uniformRand(randomState, randomIncrement, x) - 3.)
+    const unsigned int cell = sampleCells[1 + randint(RNG_ARGS, sampleCells[0])];
+    const float x = uniformRand(RNG_ARGS);
+    const float y = uniformRand(RNG_ARGS);
+
+    return (float2)(
+        SAMPLE_GRID_MIN + SAMPLE_CELL_SIZE * (cell % SAMPLE_GRID + x),
+        SAMPLE_GRID_MIN + SAMPLE_CELL_SIZE * (cell / SAMPLE_GRID + y)
     );
+}
+
+#ifdef IMPORTANCE_MAP
+
+#define SAMPLE_TABLE_SCALE 4
+#define SAMPLE_DENSITY(sampleCells) ((sampleCells) + 1 + IMPORTANCE_MAP)
+#define SAMPLE_SCORES(sampleCells) ((sampleCells) + 1 + IMPORTANCE_MAP + SAMPLE_GRID * SAMPLE_GRID)
+
+// Grid cell of an offset, -1 outside the grid
+inline int getSampleCell(float2 offset) {
+    const int x = floor((offset.x - SAMPLE_GRID_MIN) / SAMPLE_CELL_SIZE);
+    const int y = floor((offset.y - SAMPLE_GRID_MIN) / SAMPLE_CELL_SIZE);
+
+    if (x < 0 || x >= SAMPLE_GRID || y < 0 || y >= SAMPLE_GRID) {
+        return -1;
+    }
+
+    return y * SAMPLE_GRID + x;
+}
+
+// Relative density getNewPos draws offset with, offsets off the grid count as average
+inline float getSampleDensity(global const unsigned int *sampleCells, float2 offset) {
+    const int cell = getSampleCell(offset);
+
+    return cell < 0 ? SAMPLE_TABLE_SCALE : SAMPLE_DENSITY(sampleCells)[cell];
+}
+
+// There are no float atomics in OpenCL 1.2, so swap the bits until no other work item got in between
+inline void addImportance(global unsigned int *sampleCells, float2 offset, float score) {
+    const int cell = getSampleCell(offset);
+
+    if (cell < 0) {
+        return;
+    }
+
+    volatile global unsigned int *target = SAMPLE_SCORES(sampleCells) + cell;
+    unsigned int prev, current = *target;
+
+    do {
+        prev = current;
+        current = atomic_cmpxchg(target, prev, as_uint(as_float(prev) + score));
+    } while (current != prev);
+}
+
+#endif
+
+#else
+
+inline float2 getCandidate(
+    RNG_PARAMS,
+    global const unsigned int *sampleCells
+) {
+    return (float2)(
+        (9. * uniformRand(RNG_ARGS) - 5.2),
+        (6. * uniformRand(RNG_ARGS) - 3.)
+    );
+}
+
+#endif
+
+inline float2 getNewPos(
+    RNG_PARAMS,
+    global const unsigned int *sampleCells
+) {
+    float2 newOffset = getCandidate(RNG_ARGS, sampleCells);
 
     for (int i = 0; i < 50; i++) {
         if (isValid(newOffset)) {
             break;
         }
 
-        newOffset = (float2)(
-            (9. * uniformRand(randomState, randomIncrement, x) - 5.2),
-            (6. * uniformRand(randomState, randomIncrement, x) - 3.)
-        );
+        newOffset = getCandidate(RNG_ARGS, sampleCells);
     }
 
     return newOffset;
@@ -309,11 +511,10 @@ inline void resetParticle(
     Particle *particle,
     global float2 *path,
     unsigned int pathStart,
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    int x
+    RNG_PARAMS,
+    global const unsigned int *sampleCells
 ) {
-    float2 newOffset = getNewPos(randomState, randomIncrement, x);
+    float2 newOffset = getNewPos(RNG_ARGS, sampleCells);
 
     particle->iterCount = 1;
     particle->bestIter = 1;
@@ -322,8 +523,9 @@ inline void resetParticle(
     particle->prevOffset = newOffset;
     particle->score = 0;
     particle->prevScore = 0;
+    particle->proposalRatio = 1;
 
-    path[pathStart] = newOffset;
+    PATH_STORE(pathStart, newOffset)
 }
 
 inline int getScore(
@@ -333,18 +535,21 @@ inline int getScore(
     ViewSettings view
 ) {
     int score = 0;
+    float2 z = particle->offset;
+    float2 tmp;
     
     for (unsigned int i = 0; i < particle->iterCount; i++) {
-        int2 pixel = fractalToPixel(path[pathStart + i], view);
+        tmp = nextPathPos(path, pathStart + i, &z, particle->offset);
+        int2 pixel = fractalToPixel(tmp, view);
 
-        if (! (pixel.x < 0 || pixel.x >= view.sizeX || pixel.y < 0 || pixel.y >= view.sizeY)) {
+        if (! (pixel.x < 0 || pixel.x >= VIEW_SIZE_X || pixel.y < 0 || pixel.y >= VIEW_SIZE_Y)) {
             score += 1;
         }
 
-        path[pathStart + i].y = -path[pathStart + i].y;
-        pixel = fractalToPixel(path[pathStart + i], view);
+        tmp.y = -tmp.y;
+        pixel = fractalToPixel(tmp, view);
 
-        if (! (pixel.x < 0 || pixel.x >= view.sizeX || pixel.y < 0 || pixel.y >= view.sizeY)) {
+        if (! (pixel.x < 0 || pixel.x >= VIEW_SIZE_X || pixel.y < 0 || pixel.y >= VIEW_SIZE_Y)) {
             score += 1;
         }
     }
@@ -356,44 +561,110 @@ inline float getRange(uint iterCount) {
     return clamp(17 * pow(1 + iterCount, -1.), 1e-5, 0.1);
 }
 
+/**
+ * Cross-pollination. Entry i of the pool holds the best accepted state of
+ * particles i, i + POOL_SIZE, i + 2 * POOL_SIZE and so on, so a particle that
+ * jumps can land near an orbit another particle found instead of starting
+ * over, without reading the particles of other work items while they are
+ * written.
+ *
+ * This is a biased exploration aid, not a Metropolis-Hastings proposal. The
+ * reverse move is almost never possible and whether an entry is offered
+ * depends on the current score, so no proposal ratio is applied and the
+ * chains no longer keep detailed balance while it is on.
+ */
+
+#define POOL_SIZE 1024
+
+typedef struct PoolEntry {
+    float2 offset;
+    unsigned int iterCount;
+    float score;
+} PoolEntry;
+
+__kernel void updatePool(
+    global const Particle *particles,
+    global PoolEntry *pool,
+    unsigned int particleCount
+) {
+    const unsigned int x = get_global_id(0);
+    PoolEntry best = {{0, 0}, 1, 0};
+
+    for (unsigned int i = x; i < particleCount; i += POOL_SIZE) {
+        if (particles[i].prevScore > best.score) {
+            best.offset = particles[i].prevOffset;
+            best.iterCount = particles[i].bestIter;
+            best.score = particles[i].prevScore;
+        }
+    }
+
+    pool[x] = best;
+}
+
+// Only entries that score well above the particle itself are worth the jump
+inline bool getPoolEntry(
+    global const PoolEntry *pool,
+    float prevScore,
+    RNG_PARAMS,
+    PoolEntry *entry
+) {
+    *entry = pool[randint(RNG_ARGS, POOL_SIZE)];
+    const float threshold = (entry->score / (prevScore + 1) - 5) * 0.2;
+
+    return uniformRand(RNG_ARGS) < threshold;
+}
+
 inline void mutateParticle(
     global Particle *particles,
     Particle *particle,
     global float2 *path,
     unsigned int pathStart,
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    int x,
+    RNG_PARAMS,
+    global unsigned int *sampleCells,
+    global const PoolEntry *pool,
+    unsigned int crossPollinate,
     ViewSettings view
 ) {
-    if (particle->score >= particle->prevScore || particle->score / particle->prevScore > uniformRand(randomState, randomIncrement, x)) {
+#ifdef IMPORTANCE_MAP
+    if (particle->score > 0) {
+        addImportance(sampleCells, particle->offset, particle->score);
+    }
+#endif
+
+    // Metropolis-Hastings, proposals from the importance map are not symmetric
+    const float score = particle->score * particle->proposalRatio;
+
+    if (score >= particle->prevScore || score / particle->prevScore > uniformRand(RNG_ARGS)) {
         particle->prevScore = particle->score;
         particle->prevOffset = particle->offset;
         particle->bestIter = particle->iterCount;
     }
 
     float2 newOffset;
-    if (uniformRand(randomState, randomIncrement, x) < 0.98) {
+    PoolEntry entry;
+    particle->proposalRatio = 1;
+
+    if (uniformRand(RNG_ARGS) < 0.98) {
         float range = getRange(particle->iterCount);
         // float range = 0.1;
 
         newOffset = (float2)(
-            particle->prevOffset.x + range * view.scaleY * clamp(gaussianRand(randomState, randomIncrement, x), -5.f, 5.f),
-            particle->prevOffset.y + range * view.scaleY * clamp(gaussianRand(randomState, randomIncrement, x), -5.f, 5.f)
+            particle->prevOffset.x + range * view.scaleY * clamp(gaussianRand(RNG_ARGS), -5.f, 5.f),
+            particle->prevOffset.y + range * view.scaleY * clamp(gaussianRand(RNG_ARGS), -5.f, 5.f)
+        );
+    } else if (crossPollinate && getPoolEntry(pool, particle->prevScore, RNG_ARGS, &entry)) {
+        // Biased on purpose, proposalRatio stays 1, see updatePool
+        float range = getRange(entry.iterCount);
+
+        newOffset = (float2)(
+            entry.offset.x + range * view.scaleY * clamp(gaussianRand(RNG_ARGS), -5.f, 5.f),
+            entry.offset.y + range * view.scaleY * clamp(gaussianRand(RNG_ARGS), -5.f, 5.f)
         );
     } else {
-        // const unsigned int nParticles = get_global_size(0);
-        // const int y = randint(randomState, randomIncrement, x, nParticles);
-        // float threshold = (particles[y].prevScore / (particle->prevScore + 1) - 5) * 0.2;
-        // if (uniformRand(randomState, randomIncrement, x) < threshold) {
-        //     float range = getRange(particles[y].iterCount);
-        //     newOffset = (float2)(
-        //         particles[y].prevOffset.x + range * view.scaleY * clamp(gaussianRand(randomState, randomIncrement, x), -5.f, 5.f),
-        //         particles[y].prevOffset.y + range * view.scaleY * clamp(gaussianRand(randomState, randomIncrement, x), -5.f, 5.f)
-        //     );
-        // } else {
-            newOffset = getNewPos(randomState, randomIncrement, x);
-        // }
+        newOffset = getNewPos(RNG_ARGS, sampleCells);
+#ifdef IMPORTANCE_MAP
+        particle->proposalRatio = getSampleDensity(sampleCells, particle->prevOffset) / getSampleDensity(sampleCells, newOffset);
+#endif
     }
 
     particle->pos = newOffset;
@@ -401,54 +672,225 @@ inline void mutateParticle(
     particle->iterCount = 1;
     particle->score = 0;
 
-    path[pathStart] = newOffset;
+    PATH_STORE(pathStart, newOffset)
 }
 
 __kernel void initParticles(
     global Particle *particles,
     global unsigned int *threshold,
     global float2 *path,
-    global ulong *randomState,
-    global ulong *randomIncrement,
-    unsigned int thresholdCount
+    RNG_KERNEL_PARAMS,
+    unsigned int thresholdCount,
+    global const unsigned int *sampleCells
 ) {
     const int x = get_global_id(0);
+    RNG_INIT(x)
     
-    Particle foo = {{0,0}, {0,0}, {0,0}, 1, 1, 2, 2};
+    Particle foo = {{0,0}, {0,0}, {0,0}, 1, 1, 2, 2, 1};
 
     Particle tmp = particles[x];
-    resetParticle(&tmp, path, x * threshold[thresholdCount - 1], randomState, randomIncrement, x);
+    resetParticle(&tmp, path, x * THRESHOLD(THRESHOLD_COUNT_VALUE - 1), RNG_ARGS, sampleCells);
     particles[x] = tmp;
+    RNG_STORE(x)
+}
+
+// Refills the path buffer after resuming, since it isn't checkpointed. The
+// orbit is recomputed from the offset up to the saved iterCount, pos and
+// iterCount are left alone so the particle continues where it stopped.
+__kernel void rewindParticles(
+    global Particle *particles,
+    global unsigned int *threshold,
+    global float2 *path,
+    unsigned int thresholdCount
+) {
+    const int x = get_global_id(0);
+    const unsigned int pathStart = x * THRESHOLD(THRESHOLD_COUNT_VALUE - 1);
+    const Particle tmp = particles[x];
+    float2 z = tmp.offset;
+
+    PATH_STORE(pathStart, z)
+
+    for (unsigned int i = 1; i < tmp.iterCount; i++) {
+        z = csquare(z) + tmp.offset;
+        PATH_STORE(pathStart + i, z)
+    }
+}
+
+/**
+ * Work-group privatized histogram. With LOCAL_HISTOGRAM every work group keeps
+ * a small hashed cache of pixel counts in local memory and only touches the
+ * global count buffer when the cache is flushed, or when a pixel collides with
+ * a slot already claimed by another pixel. Deep zooms concentrate orbits in few
+ * pixels, which is exactly where the global atomics serialise.
+ */
+
+#ifdef LOCAL_HISTOGRAM
+
+#ifndef HISTOGRAM_BITS
+#define HISTOGRAM_BITS 11
+#endif
+
+#ifndef HISTOGRAM_FLUSH_INTERVAL
+#define HISTOGRAM_FLUSH_INTERVAL 100
+#endif
+
+#define HISTOGRAM_BINS (1 << HISTOGRAM_BITS)
+
+inline void histogramClear(local unsigned int *binKeys, local unsigned int *binCounts) {
+    for (unsigned int i = get_local_id(0); i < HISTOGRAM_BINS; i += get_local_size(0)) {
+        binKeys[i] = 0;
+        binCounts[i] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Every item in the group has to call this
+inline void histogramFlush(global unsigned int *count, local unsigned int *binKeys, local unsigned int *binCounts) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned int i = get_local_id(0); i < HISTOGRAM_BINS; i += get_local_size(0)) {
+        if (binKeys[i] != 0) {
+            atomic_add(&count[binKeys[i] - 1], binCounts[i]);
+        }
+
+        binKeys[i] = 0;
+        binCounts[i] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Keys are stored as index + 1 so that 0 marks an empty slot
+inline void histogramInc(
+    global unsigned int *count,
+    local unsigned int *binKeys,
+    local unsigned int *binCounts,
+    unsigned int index
+) {
+    const unsigned int key = index + 1;
+    const unsigned int slot = (key * 2654435761U) >> (32 - HISTOGRAM_BITS);
+
+    unsigned int current = binKeys[slot];
+    if (current == 0) {
+        current = atomic_cmpxchg(&binKeys[slot], 0, key);
+    }
+
+    if (current == 0 || current == key) {
+        atomic_inc(&binCounts[slot]);
+    } else {
+        atomic_inc(&count[index]);
+    }
+}
+
+#define HISTOGRAM_PARAMS , local unsigned int *binKeys, local unsigned int *binCounts
+#define HISTOGRAM_ARGS , binKeys, binCounts
+#define HISTOGRAM_DECLARE \
+    local unsigned int binKeys[HISTOGRAM_BINS]; \
+    local unsigned int binCounts[HISTOGRAM_BINS]; \
+    histogramClear(binKeys, binCounts);
+#define HISTOGRAM_FLUSH(i) \
+    if ((i + 1) % HISTOGRAM_FLUSH_INTERVAL == 0 || i + 1 == STEP_ITERATIONS) { \
+        histogramFlush(count, binKeys, binCounts); \
+    }
+#define HISTOGRAM_FINISH histogramFlush(count, binKeys, binCounts);
+#define COUNT_INC(index) histogramInc(count, binKeys, binCounts, index);
+
+#else
+
+#define HISTOGRAM_PARAMS
+#define HISTOGRAM_ARGS
+#define HISTOGRAM_DECLARE
+#define HISTOGRAM_FLUSH(i)
+#define HISTOGRAM_FINISH
+#define COUNT_INC(index) atomic_inc(&count[index]);
+
+#endif
+
+/**
+ * Throughput counters for --bench. With BENCH_STATS every work-item counts
+ * the orbit iterations it computed and the orbits it splatted, and adds them
+ * to the stats buffer once at the end. The counters are 64 bit, stored as
+ * low and high words since 64 bit atomics are optional.
+ */
+
+#define STATS_ITERATIONS_INDEX 0
+#define STATS_SAMPLES_INDEX 2
+#define STATS_SAVED_INDEX 4
+
+#ifdef BENCH_STATS
+
+inline void statsAdd(global unsigned int *stats, unsigned int index, unsigned int value) {
+    if (value > 0 && atomic_add(&stats[index], value) > 0xFFFFFFFF - value) {
+        atomic_inc(&stats[index + 1]);
+    }
 }
 
+#define STATS_PARAMS , global unsigned int *stats
+#define STATS_DECLARE unsigned int statIterations = 0, statSamples = 0, statSaved = 0;
+#define STATS_ITERATIONS(n) statIterations += n;
+#define STATS_SAMPLE statSamples++;
+#define STATS_SAVED(n) statSaved += n;
+#define STATS_FINISH \
+    statsAdd(stats, STATS_ITERATIONS_INDEX, statIterations); \
+    statsAdd(stats, STATS_SAMPLES_INDEX, statSamples); \
+    statsAdd(stats, STATS_SAVED_INDEX, statSaved);
+
+#else
+
+#define STATS_PARAMS
+#define STATS_DECLARE
+#define STATS_ITERATIONS(n)
+#define STATS_SAMPLE
+#define STATS_SAVED(n)
+#define STATS_FINISH
+
+#endif
+
+/**
+ * With DETERMINISTIC the path deltas read the counts from a snapshot taken
+ * before the launch instead of the buffer other work-items are incrementing,
+ * so a particle's trajectory only depends on its own random stream and the
+ * histogram comes out the same on every run with the same seed.
+ */
+
+#ifdef DETERMINISTIC
+#define PATH_COUNT snapshot
+#else
+#define PATH_COUNT count
+#endif
+
 // I'm so sorry... There are no function pointers so I had to resort to this
 #define PATH_DEF(EXTENSION, DELTA_SCORE) \
 inline void addPath_##EXTENSION( \
     Particle *particle, \
     global float2 *path, \
     global unsigned int *count, \
+    global unsigned int *snapshot, \
     global unsigned int *threshold, \
     unsigned int thresholdCount, \
     unsigned int pathStart, \
     int thresholdIndex, \
     ViewSettings view \
+    HISTOGRAM_PARAMS \
 ) { \
-    unsigned int pixelCount = view.sizeX * view.sizeY; \
+    unsigned int pixelCount = VIEW_SIZE_X * VIEW_SIZE_Y; \
+    float2 z = particle->offset; \
     float2 tmp; \
     \
     for (unsigned int i = 0; i < particle->iterCount; i++) { \
-        tmp = path[pathStart + i]; \
+        tmp = nextPathPos(path, pathStart + i, &z, particle->offset); \
         int2 pixel = fractalToPixel(tmp, view); \
     \
-        if (! (pixel.x < 0 || pixel.x >= view.sizeX || pixel.y < 0 || pixel.y >= view.sizeY)) { \
-            atomic_inc(&count[thresholdIndex * pixelCount + view.sizeX * pixel.y + pixel.x]); \
+        if (! (pixel.x < 0 || pixel.x >= VIEW_SIZE_X || pixel.y < 0 || pixel.y >= VIEW_SIZE_Y)) { \
+            COUNT_INC(thresholdIndex * pixelCount + VIEW_SIZE_X * pixel.y + pixel.x) \
             particle->score += DELTA_SCORE; \
         } \
     \
         tmp.y = -tmp.y; \
         pixel = fractalToPixel(tmp, view); \
-        if (! (pixel.x < 0 || pixel.x >= view.sizeX || pixel.y < 0 || pixel.y >= view.sizeY)) { \
-            atomic_inc(&count[thresholdIndex * pixelCount + view.sizeX * pixel.y + pixel.x]); \
+        if (! (pixel.x < 0 || pixel.x >= VIEW_SIZE_X || pixel.y < 0 || pixel.y >= VIEW_SIZE_Y)) { \
+            COUNT_INC(thresholdIndex * pixelCount + VIEW_SIZE_X * pixel.y + pixel.x) \
             particle->score += DELTA_SCORE; \
         } \
     } \
@@ -456,10 +898,69 @@ inline void addPath_##EXTENSION( \
 
 constant unsigned int MAX_CONVERGE_STEPS = 500;
 
+/**
+ * Brent's cycle detection on the positions after each group of substeps.
+ * An orbit that comes back within CYCLE_TOLERANCE of an earlier point is
+ * bounded, so the particle is reset right away instead of iterating up to
+ * maxLength. The state is private to one launch and restarts whenever the
+ * particle moves to a new offset.
+ */
+
+#ifdef CYCLE_TOLERANCE
+
+typedef struct CycleState {
+    float2 offset, ref;
+    unsigned int power, length;
+} CycleState;
+
+inline bool cycleFound(Particle *particle, CycleState *cycle) {
+    if (any(particle->offset != cycle->offset)) {
+        cycle->offset = particle->offset;
+        cycle->ref = particle->pos;
+        cycle->power = 1;
+        cycle->length = 0;
+        return false;
+    }
+
+    if (fabs(particle->pos.x - cycle->ref.x) <= CYCLE_TOLERANCE && fabs(particle->pos.y - cycle->ref.y) <= CYCLE_TOLERANCE) {
+        return true;
+    }
+
+    if (++cycle->length == cycle->power) {
+        cycle->ref = particle->pos;
+        cycle->power *= 2;
+        cycle->length = 0;
+    }
+
+    return false;
+}
+
+#define CYCLE_DECLARE CycleState cycle = {tmp.offset, tmp.pos, 1, 0};
+#define CYCLE_CHECK || cycleFound(&tmp, &cycle)
+
+#else
+
+#define CYCLE_DECLARE
+#define CYCLE_CHECK
+
+#endif
+
+// Iterations a cycle reset skipped, zero when the particle really reached maxLength
+#define SAVED_ITERATIONS (tmp.iterCount < maxLength ? maxLength - tmp.iterCount : 0)
+
+// The host passes SUBSTEPS as the unroll factor, with STEP_ITERATIONS * SUBSTEPS = 4000
+#ifndef SUBSTEPS
+#define SUBSTEPS 5
+#endif
+
+#ifndef STEP_ITERATIONS
+#define STEP_ITERATIONS (4000 / SUBSTEPS)
+#endif
+
 // Just messing around with the precompiler ok get off my ass :(
 #define SUBSTEP \
     tmp.pos = csquare(tmp.pos) + tmp.offset; \
-    path[pathIndex + tmp.iterCount] = tmp.pos; \
+    PATH_STORE(pathIndex + tmp.iterCount, tmp.pos) \
     tmp.iterCount++;
 
 #define MANDEL_DEF(PATH_EXT, SCORE_EXT) \
@@ -468,20 +969,31 @@ __kernel void mandelStep_##PATH_EXT##_##SCORE_EXT( \
     global unsigned int *count, \
     global unsigned int *threshold, \
     global float2 *path, \
-    global ulong *randomState, \
-    global ulong *randomIncrement, \
+    RNG_KERNEL_PARAMS, \
     unsigned int thresholdCount, \
-    ViewSettings view \
+    ViewSettings view, \
+    global unsigned int *snapshot, \
+    global unsigned int *sampleCells, \
+    global const PoolEntry *pool, \
+    unsigned int crossPollinate \
+    STATS_PARAMS \
 ) { \
     const int x = get_global_id(0); \
-    const unsigned int maxLength = threshold[thresholdCount - 1]; \
+    const unsigned int maxLength = THRESHOLD(THRESHOLD_COUNT_VALUE - 1); \
     const unsigned int pathIndex = x * maxLength; \
+    RNG_INIT(x) \
 \
     Particle tmp = particles[x]; \
     bool escaped = false; \
+    CYCLE_DECLARE \
+    HISTOGRAM_DECLARE \
+    STATS_DECLARE \
 \
-    for (int i = 0; i < 800; i++) { \
-        SUBSTEP SUBSTEP SUBSTEP SUBSTEP SUBSTEP \
+    for (int i = 0; i < STEP_ITERATIONS; i++) { \
+        for (int j = 0; j < SUBSTEPS; j++) { \
+            SUBSTEP \
+        } \
+        STATS_ITERATIONS(SUBSTEPS) \
 \
         escaped = fabs(tmp.pos.x) > 4 || fabs(tmp.pos.y) > 4 || cnorm2(tmp.pos) > 16; \
 \
@@ -489,65 +1001,323 @@ __kernel void mandelStep_##PATH_EXT##_##SCORE_EXT( \
             tmp.prevScore = getScore(&tmp, path, pathIndex, view); \
             if (tmp.prevScore < 10) { \
                 tmp.prevOffset = tmp.offset; \
-                tmp.pos = getNewPos(randomState, randomIncrement, x); \
+                tmp.pos = getNewPos(RNG_ARGS, sampleCells); \
                 tmp.offset = tmp.pos; \
                 tmp.iterCount = 1; \
                 tmp.score = 0; \
+                tmp.proposalRatio = 1; \
             } \
         } if (escaped) { \
             int thresholdIndex = matchThreshold(tmp, threshold, thresholdCount); \
-            addPath_##PATH_EXT(&tmp, path, count, threshold, thresholdCount, pathIndex, thresholdIndex, view); \
+            addPath_##PATH_EXT(&tmp, path, count, snapshot, threshold, thresholdCount, pathIndex, thresholdIndex, view HISTOGRAM_ARGS); \
             SCORE_##SCORE_EXT \
-            mutateParticle(particles, &tmp, path, pathIndex, randomState, randomIncrement, x, view); \
+            mutateParticle(particles, &tmp, path, pathIndex, RNG_ARGS, sampleCells, pool, crossPollinate, view); \
+            STATS_SAMPLE \
         } \
 \
-        else if (tmp.iterCount >= maxLength) { \
-            resetParticle(&tmp, path, pathIndex, randomState, randomIncrement, x); \
+        else if (tmp.iterCount >= maxLength CYCLE_CHECK) { \
+            STATS_SAVED(SAVED_ITERATIONS) \
+            resetParticle(&tmp, path, pathIndex, RNG_ARGS, sampleCells); \
         } \
+\
+        HISTOGRAM_FLUSH(i) \
     } \
 \
     particles[x] = tmp; \
+    RNG_STORE(x) \
+    STATS_FINISH \
 }
 
 PATH_DEF(constant, 1)
-PATH_DEF(sqrt, 1. / (1 + count[thresholdIndex * pixelCount + view.sizeX * pixel.y + pixel.x]))
-PATH_DEF(linear, 1. / (1 + sqrt(1. + count[thresholdIndex * pixelCount + view.sizeX * pixel.y + pixel.x])))
-PATH_DEF(square, 1. / (1 + pown((float)count[thresholdIndex * pixelCount + view.sizeX * pixel.y + pixel.x], 2)))
+PATH_DEF(sqrt, 1. / (1 + PATH_COUNT[thresholdIndex * pixelCount + VIEW_SIZE_X * pixel.y + pixel.x]))
+PATH_DEF(linear, 1. / (1 + sqrt(1. + PATH_COUNT[thresholdIndex * pixelCount + VIEW_SIZE_X * pixel.y + pixel.x])))
+PATH_DEF(square, 1. / (1 + pown((float)PATH_COUNT[thresholdIndex * pixelCount + VIEW_SIZE_X * pixel.y + pixel.x], 2)))
 
 #define SCORE_none
 #define SCORE_sqrt tmp.score = sqrt(tmp.score);
 #define SCORE_square tmp.score = pown(tmp.score, 2);
-#define SCORE_norm tmp.score = tmp.score / threshold[thresholdIndex];
-#define SCORE_sqnorm tmp.score = pown(tmp.score, 2) / threshold[thresholdIndex];
+#define SCORE_norm tmp.score = tmp.score / THRESHOLD(thresholdIndex);
+#define SCORE_sqnorm tmp.score = pown(tmp.score, 2) / THRESHOLD(thresholdIndex);
 
-#define PATH_LOOP(SCORE_EXT) MANDEL_DEF(constant, SCORE_EXT) MANDEL_DEF(sqrt, SCORE_EXT) MANDEL_DEF(linear, SCORE_EXT) MANDEL_DEF(square, SCORE_EXT)
+/**
+ * Persistent-thread variant of mandelStep, split in two phases so the lanes
+ * of a wavefront do the same kind of work. A fixed number of work groups
+ * pull batches of particles from a global counter. mandelEscape iterates
+ * every particle until it escapes (or the budget runs out) and appends the
+ * escaped ones to splatList, after which mandelSplat does addPath, scoring
+ * and mutation for just those particles. resetQueue has to run before every
+ * escape and splat pair.
+ */
+
+#define QUEUE_ESCAPE 0
+#define QUEUE_SPLAT_COUNT 1
+#define QUEUE_SPLAT_NEXT 2
+#define QUEUE_SIZE 4
+
+__kernel void resetQueue(global unsigned int *queue) {
+    queue[get_global_id(0)] = 0;
+}
+
+// Claims the next get_local_size(0) jobs for the whole group, so loops over it stay uniform
+inline unsigned int nextBatch(global unsigned int *counter, local unsigned int *batchStart) {
+    if (get_local_id(0) == 0) {
+        *batchStart = atomic_add(counter, get_local_size(0));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const unsigned int start = *batchStart;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return start;
+}
+
+// Returns the number of orbit iterations done, saved gets the iterations skipped by cycle resets
+inline unsigned int escapeParticle(
+    global Particle *particles,
+    global unsigned int *threshold,
+    global float2 *path,
+    RNG_KERNEL_PARAMS,
+    global unsigned int *queue,
+    global unsigned int *splatList,
+    unsigned int thresholdCount,
+    ViewSettings view,
+    global const unsigned int *sampleCells,
+    unsigned int x,
+    unsigned int *saved
+) {
+    const unsigned int maxLength = THRESHOLD(THRESHOLD_COUNT_VALUE - 1);
+    const unsigned int pathIndex = x * maxLength;
+    RNG_INIT(x)
+
+    Particle tmp = particles[x];
+    bool escaped = false;
+    CYCLE_DECLARE
+    int i = 0;
+
+    for (; i < STEP_ITERATIONS && !escaped; i++) {
+        for (int j = 0; j < SUBSTEPS; j++) {
+            SUBSTEP
+        }
+
+        escaped = fabs(tmp.pos.x) > 4 || fabs(tmp.pos.y) > 4 || cnorm2(tmp.pos) > 16;
+
+        if (tmp.prevScore < 10 && (tmp.iterCount > MAX_CONVERGE_STEPS || escaped)) {
+            tmp.prevScore = getScore(&tmp, path, pathIndex, view);
+            if (tmp.prevScore < 10) {
+                tmp.prevOffset = tmp.offset;
+                tmp.pos = getNewPos(RNG_ARGS, sampleCells);
+                tmp.offset = tmp.pos;
+                tmp.iterCount = 1;
+                tmp.score = 0;
+                tmp.proposalRatio = 1;
+            }
+        }
+
+        if (escaped) {
+            splatList[atomic_inc(&queue[QUEUE_SPLAT_COUNT])] = x;
+        } else if (tmp.iterCount >= maxLength CYCLE_CHECK) {
+            *saved += SAVED_ITERATIONS;
+            resetParticle(&tmp, path, pathIndex, RNG_ARGS, sampleCells);
+        }
+    }
+
+    particles[x] = tmp;
+    RNG_STORE(x)
+
+    return i * SUBSTEPS;
+}
+
+__kernel void mandelEscape(
+    global Particle *particles,
+    global unsigned int *threshold,
+    global float2 *path,
+    RNG_KERNEL_PARAMS,
+    global unsigned int *queue,
+    global unsigned int *splatList,
+    unsigned int thresholdCount,
+    ViewSettings view,
+    unsigned int particleCount,
+    global const unsigned int *sampleCells
+    STATS_PARAMS
+) {
+    local unsigned int batchStart;
+    STATS_DECLARE
+
+    while (true) {
+        const unsigned int start = nextBatch(&queue[QUEUE_ESCAPE], &batchStart);
+        const unsigned int x = start + get_local_id(0);
+
+        if (start >= particleCount) {
+            break;
+        }
+
+        if (x < particleCount) {
+            unsigned int saved = 0;
+            const unsigned int iterations = escapeParticle(particles, threshold, path, RNG_KERNEL_ARGS, queue, splatList, thresholdCount, view, sampleCells, x, &saved);
+            STATS_ITERATIONS(iterations)
+            STATS_SAVED(saved)
+        }
+    }
+
+    STATS_FINISH
+}
+
+// Same arguments as mandelStep followed by the queue, so the host can share the setup
+#define SPLAT_DEF(PATH_EXT, SCORE_EXT) \
+__kernel void mandelSplat_##PATH_EXT##_##SCORE_EXT( \
+    global Particle *particles, \
+    global unsigned int *count, \
+    global unsigned int *threshold, \
+    global float2 *path, \
+    RNG_KERNEL_PARAMS, \
+    unsigned int thresholdCount, \
+    ViewSettings view, \
+    global unsigned int *snapshot, \
+    global unsigned int *sampleCells, \
+    global const PoolEntry *pool, \
+    unsigned int crossPollinate, \
+    global unsigned int *queue, \
+    global unsigned int *splatList \
+    STATS_PARAMS \
+) { \
+    local unsigned int batchStart; \
+    const unsigned int maxLength = THRESHOLD(THRESHOLD_COUNT_VALUE - 1); \
+    const unsigned int splatCount = queue[QUEUE_SPLAT_COUNT]; \
+    HISTOGRAM_DECLARE \
+    STATS_DECLARE \
+\
+    for (unsigned int i = 0; ; i++) { \
+        const unsigned int start = nextBatch(&queue[QUEUE_SPLAT_NEXT], &batchStart); \
+\
+        if (start >= splatCount) { \
+            break; \
+        } \
+\
+        if (start + get_local_id(0) < splatCount) { \
+            const unsigned int x = splatList[start + get_local_id(0)]; \
+            const unsigned int pathIndex = x * maxLength; \
+            RNG_INIT(x) \
+            Particle tmp = particles[x]; \
+\
+            int thresholdIndex = matchThreshold(tmp, threshold, thresholdCount); \
+            addPath_##PATH_EXT(&tmp, path, count, snapshot, threshold, thresholdCount, pathIndex, thresholdIndex, view HISTOGRAM_ARGS); \
+            SCORE_##SCORE_EXT \
+            mutateParticle(particles, &tmp, path, pathIndex, RNG_ARGS, sampleCells, pool, crossPollinate, view); \
+\
+            particles[x] = tmp; \
+            RNG_STORE(x) \
+            STATS_SAMPLE \
+        } \
+\
+        HISTOGRAM_FLUSH(i) \
+    } \
+\
+    HISTOGRAM_FINISH \
+    STATS_FINISH \
+}
+
+#define MANDEL_VARIANTS(PATH_EXT, SCORE_EXT) MANDEL_DEF(PATH_EXT, SCORE_EXT) SPLAT_DEF(PATH_EXT, SCORE_EXT)
+
+#define PATH_LOOP(SCORE_EXT) MANDEL_VARIANTS(constant, SCORE_EXT) MANDEL_VARIANTS(sqrt, SCORE_EXT) MANDEL_VARIANTS(linear, SCORE_EXT) MANDEL_VARIANTS(square, SCORE_EXT)
 #define SCORE_LOOP PATH_LOOP(none) PATH_LOOP(sqrt) PATH_LOOP(square) PATH_LOOP(norm) PATH_LOOP(sqnorm)
 
+/**
+ * The host builds one program per path and score combination on demand, with
+ * PATH_TYPE and SCORE_TYPE set to the PathOptions and ScoreOptions values.
+ * ALL_MANDEL_KERNELS builds every variant at once like before.
+ */
+
+#if defined(PATH_TYPE) && defined(SCORE_TYPE)
+
+#if PATH_TYPE == 0
+#define MANDEL_PATH(SCORE_EXT) MANDEL_VARIANTS(constant, SCORE_EXT)
+#elif PATH_TYPE == 1
+#define MANDEL_PATH(SCORE_EXT) MANDEL_VARIANTS(sqrt, SCORE_EXT)
+#elif PATH_TYPE == 2
+#define MANDEL_PATH(SCORE_EXT) MANDEL_VARIANTS(linear, SCORE_EXT)
+#else
+#define MANDEL_PATH(SCORE_EXT) MANDEL_VARIANTS(square, SCORE_EXT)
+#endif
+
+#if SCORE_TYPE == 0
+MANDEL_PATH(none)
+#elif SCORE_TYPE == 1
+MANDEL_PATH(sqrt)
+#elif SCORE_TYPE == 2
+MANDEL_PATH(square)
+#elif SCORE_TYPE == 3
+MANDEL_PATH(norm)
+#else
+MANDEL_PATH(sqnorm)
+#endif
+
+#elif defined(ALL_MANDEL_KERNELS)
 SCORE_LOOP
+#endif
 
 /**
- * Global operations, to be optimised later
+ * Global operations
+ *
+ * The maxima are reduced in two passes. The reduction kernels run on a 2D range
+ * where the second dimension is the threshold and the first is a fixed number
+ * of work groups of REDUCE_SIZE items, so any image size works. The first pass
+ * writes one partial maximum per work group, the second reduces those with a
+ * single work group per threshold.
  */
 
-__kernel void findMax1(global unsigned int *count, global unsigned int *maxima, unsigned int size) {
-    const int x = get_global_id(0);
-    maxima[x] = 0;
+#define REDUCE_SIZE 128
+
+// Tree reduction of scratch into scratch[0], every item in the group has to call this
+inline void reduceLocalMax(local unsigned int *scratch) {
+    const unsigned int lid = get_local_id(0);
 
-    for (unsigned int i = x * size; i < (x + 1) * size; i++) {
-        if (count[i] > maxima[x]) {
-            maxima[x] = count[i];
+    for (unsigned int stride = REDUCE_SIZE / 2; stride > 0; stride >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (lid < stride) {
+            scratch[lid] = max(scratch[lid], scratch[lid + stride]);
         }
     }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+__kernel void findMax1(global unsigned int *count, global unsigned int *maxima, unsigned int pixelCount) {
+    const unsigned int lid = get_local_id(0);
+    const unsigned int thresholdIndex = get_global_id(1);
+    global unsigned int *layer = count + thresholdIndex * pixelCount;
+
+    local unsigned int scratch[REDUCE_SIZE];
+    unsigned int result = 0;
+
+    for (unsigned int i = get_global_id(0); i < pixelCount; i += get_global_size(0)) {
+        result = max(result, layer[i]);
+    }
+
+    scratch[lid] = result;
+    reduceLocalMax(scratch);
+
+    if (lid == 0) {
+        maxima[thresholdIndex * get_num_groups(0) + get_group_id(0)] = scratch[0];
+    }
 }
 
 __kernel void findMax2(global unsigned int *maxima, global unsigned int *maximum, unsigned int size) {
-    const int x = get_global_id(0);
-    maximum[x] = 0;
+    const unsigned int lid = get_local_id(0);
+    const unsigned int thresholdIndex = get_global_id(1);
 
-    for (unsigned int i = x * size; i < (x + 1) * size; i++) {
-        if (maxima[i] > maximum[x]) {
-            maximum[x] = maxima[i];
-        }
+    local unsigned int scratch[REDUCE_SIZE];
+    unsigned int result = 0;
+
+    for (unsigned int i = lid; i < size; i += REDUCE_SIZE) {
+        result = max(result, maxima[thresholdIndex * size + i]);
+    }
+
+    scratch[lid] = result;
+    reduceLocalMax(scratch);
+
+    if (lid == 0) {
+        maximum[thresholdIndex] = scratch[0];
     }
 }
 
@@ -581,10 +1351,23 @@ __constant float COLOR_SCHEME[3][3] = {
 
 __constant float IMAGE_MAX = 4294967295.0;
 
+// 8 writes packed RGBA8, 16 RGBA16 with the bytes swapped to PNG's big-endian order
+#ifndef OUTPUT_BITS
+#define OUTPUT_BITS 32
+#endif
+
+#if OUTPUT_BITS == 8
+#define IMAGE_TYPE uchar4
+#elif OUTPUT_BITS == 16
+#define IMAGE_TYPE ushort4
+#else
+#define IMAGE_TYPE unsigned int
+#endif
+
  __kernel void renderImage(
     global unsigned int *count,
     global unsigned int *maximum,
-    global unsigned int *image,
+    global IMAGE_TYPE *image,
     unsigned int thresholdCount
 ) {
     const int x = get_global_id(0);
@@ -595,6 +1378,8 @@ __constant float IMAGE_MAX = 4294967295.0;
 
     const unsigned int pixelOffset = W * y + x;
     unsigned int pixelCount = W * H;
+
+#if OUTPUT_BITS == 32
     const unsigned int imageOffset = 3 * pixelOffset;
 
     for (uint j = 0; j < 3; j++) {
@@ -610,27 +1395,68 @@ __constant float IMAGE_MAX = 4294967295.0;
             image[imageOffset + j] = 4294967295;
         }
     }
+#else
+    float3 color = 0;
+
+    for (uint i = 0; i < thresholdCount; i++) {
+        float countFraction = (float)count[i * pixelCount + pixelOffset] / (float)(maximum[i] + 1);
+        color += (float3)(COLOR_SCHEME[i][0], COLOR_SCHEME[i][1], COLOR_SCHEME[i][2]) * sqrt(countFraction);
+    }
+
+    color = min(color, 1.f);
+
+#if OUTPUT_BITS == 8
+    image[pixelOffset] = (uchar4)(convert_uchar3(color * 255), 255);
+#else
+    ushort3 channels = convert_ushort3(color * 65535);
+    image[pixelOffset] = (ushort4)(rotate(channels, (ushort3)8), 65535);
+#endif
+#endif
 }
 
+// Also does the first reduction pass for both count and countDiff, so the
+// maxima only need findMax2 afterwards. Launched like findMax1.
 __kernel void updateDiff(
     global unsigned int *count,
     global unsigned int *prevCount,
     global unsigned int *countDiff,
+    global unsigned int *maxima,
+    global unsigned int *maximaDiff,
     float alpha,
-    unsigned int thresholdCount
+    unsigned int pixelCount
 ) {
-    const int x = get_global_id(0);
-    const int y = get_global_id(1);
+    const unsigned int lid = get_local_id(0);
+    const unsigned int thresholdIndex = get_global_id(1);
+    const unsigned int layer = thresholdIndex * pixelCount;
+    const unsigned int partial = thresholdIndex * get_num_groups(0) + get_group_id(0);
 
-    const int W = get_global_size(0);
-    const int H = get_global_size(1);
+    local unsigned int scratch[REDUCE_SIZE];
+    unsigned int countMax = 0, diffMax = 0;
+    unsigned int ind, value, diff;
 
-    unsigned int pixelCount = W * H;
-    unsigned int ind;
+    for (unsigned int i = get_global_id(0); i < pixelCount; i += get_global_size(0)) {
+        ind = layer + i;
+        value = count[ind];
+        diff = countDiff[ind] * alpha + value - prevCount[ind];
+
+        countDiff[ind] = diff;
+        prevCount[ind] = value;
+
+        countMax = max(countMax, value);
+        diffMax = max(diffMax, diff);
+    }
+
+    scratch[lid] = countMax;
+    reduceLocalMax(scratch);
+
+    if (lid == 0) {
+        maxima[partial] = scratch[0];
+    }
+
+    scratch[lid] = diffMax;
+    reduceLocalMax(scratch);
 
-    for (unsigned int i = 0; i < thresholdCount; i++) {
-        ind = i * pixelCount + W * y + x;
-        countDiff[ind] = countDiff[ind] * alpha + count[ind] - prevCount[ind];
-        prevCount[ind] = count[ind];
+    if (lid == 0) {
+        maximaDiff[partial] = scratch[0];
     }
 }
@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "config.hpp"
+#include "fractalWindow.hpp"
+#include "image.hpp"
+
+using namespace std;
+
+/**
+ * Benchmark suite, run with ./buddha.out --bench or make bench. Each
+ * scenario builds the backend from scratch, does one warmup launch, then
+ * times bench_steps mandelStep launches followed by bench_steps rounds of
+ * the reductions and renderImage. The table goes to stdout and the full
+ * results, including the per-kernel event times, to bench_output as JSON.
+ * The converge scenarios first time how long freshly seeded particles take
+ * to fill a deep zoom, see measureConvergence.
+ */
+
+typedef struct BenchView {
+    string name;
+    float scale, centerX, centerY, theta;
+    unsigned int width, height; // 0 keeps the size from the config
+} BenchView;
+
+typedef struct BenchScenario {
+    string name;
+    BenchView view;
+    int pathType, scoreType;
+    bool localHistogram;
+    bool persistent;
+    bool crossPollinate;
+    bool converge;
+} BenchScenario;
+
+typedef struct BenchResult {
+    BenchScenario scenario;
+    unsigned int width, height;
+    float seconds, renderSeconds;
+    uint64_t iterations, samples, increments, saved;
+    float convergeSeconds;
+    unsigned int convergeSteps;
+    bool converged;
+    vector<KernelTime> kernelTimes;
+} BenchResult;
+
+const unsigned int BENCH_SEED = 1234;
+
+// The default view and the presets from config.cfg
+const vector<BenchView> benchViews = {
+    {"default",  1.3,     -0.5,     0.,       0.,     0,    0},
+    {"preset_1", 0.124,   0.670,    0.707,    0.467,  0,    0},
+    {"preset_2", 0.00282, 0.66722,  0.63991,  0.067,  0,    0},
+    {"preset_3", 0.05908, -1.16177, -0.75446, 0.3144, 0,    0},
+    {"preset_4", 0.17572, 1.19722,  0.07222,  0.1651, 0,    0},
+    {"banner",   0.112,   -0.377,   0.902,    -0.236, 5734, 558},
+};
+
+const vector<string> benchPaths = {"constant", "sqrt", "linear", "square"};
+const vector<string> benchScores = {"none", "sqrt", "square", "norm", "sqnorm"};
+
+vector<BenchScenario> createScenarios() {
+    vector<BenchScenario> scenarios;
+
+    for (BenchView view : benchViews) {
+        scenarios.push_back({view.name, view, 0, 0, false, false, false, false});
+
+        // The CPU engine has neither a local histogram nor a persistent variant
+        if (!config->cpu_engine) {
+            scenarios.push_back({view.name, view, 0, 0, true, false, false, false});
+            scenarios.push_back({view.name, view, 0, 0, false, true, false, false});
+            scenarios.push_back({view.name, view, 0, 0, true, true, false, false});
+        }
+    }
+
+    for (size_t i = 0; i < benchPaths.size(); i++) {
+        for (size_t j = 0; j < benchScores.size(); j++) {
+            scenarios.push_back({"mode_" + benchPaths[i] + "_" + benchScores[j], benchViews[0], (int)i, (int)j, false, false, false, false});
+        }
+    }
+
+    // The deepest preset, with and without cross-pollination
+    scenarios.push_back({"converge", benchViews[2], 0, 0, false, false, false, true});
+    scenarios.push_back({"converge_cross", benchViews[2], 0, 0, false, false, true, true});
+
+    return scenarios;
+}
+
+uint64_t sumCounts() {
+    size_t size = config->threshold_count * config->width * config->height;
+    uint32_t *counts = (uint32_t *)malloc(size * sizeof(uint32_t));
+    uint64_t sum = 0;
+
+    fetchCounts(counts);
+
+    for (size_t i = 0; i < size; i++) {
+        sum += counts[i];
+    }
+
+    free(counts);
+
+    return sum;
+}
+
+// Kernel times of the frame that finishSteps just closed, merged by name
+void addKernelTimes(vector<KernelTime> &target) {
+    if (!opencl) {
+        return;
+    }
+
+    for (KernelTime kernelTime : opencl->kernelTimes) {
+        bool found = false;
+
+        for (KernelTime &existing : target) {
+            if (existing.name == kernelTime.name) {
+                existing.time += kernelTime.time;
+                existing.launches += kernelTime.launches;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            target.push_back(kernelTime);
+        }
+    }
+}
+
+float secondsSince(chrono::high_resolution_clock::time_point start) {
+    chrono::duration<float> time_span = chrono::duration_cast<chrono::duration<float>>(chrono::high_resolution_clock::now() - start);
+    return time_span.count();
+}
+
+/**
+ * Launches from freshly seeded particles until the view holds bench_converge
+ * increments per pixel on average, or bench_converge_steps launches are done.
+ * Only the launches are timed, not the reads of the counts in between.
+ */
+void measureConvergence(BenchResult &result) {
+    const uint64_t target = config->bench_converge * config->width * config->height;
+
+    result.convergeSeconds = 0;
+    result.converged = false;
+
+    for (result.convergeSteps = 0; result.convergeSteps < config->bench_converge_steps && !result.converged;) {
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        stepMandel(1);
+        finishSteps();
+        result.convergeSeconds += secondsSince(start);
+        result.convergeSteps++;
+
+        result.converged = sumCounts() >= target;
+    }
+}
+
+BenchResult runScenario(BenchScenario scenario, unsigned int width, unsigned int height) {
+    config->scale = scenario.view.scale;
+    config->center_x = scenario.view.centerX;
+    config->center_y = scenario.view.centerY;
+    config->theta = scenario.view.theta;
+    config->width = scenario.view.width > 0 ? scenario.view.width : width;
+    config->height = scenario.view.height > 0 ? scenario.view.height : height;
+    config->path_type = scenario.pathType;
+    config->score_type = scenario.scoreType;
+    config->local_histogram = scenario.localHistogram;
+    config->persistent_threads = scenario.persistent;
+    config->cross_pollinate = scenario.crossPollinate;
+
+    fprintf(stderr, "Running %s\n", scenario.name.c_str());
+
+    prepare();
+    pixelsFW = (uint32_t *)malloc(getImageSize(config->output_bits, config->width * config->height));
+
+    BenchResult result = {scenario, config->width, config->height};
+
+    if (scenario.converge) {
+        measureConvergence(result);
+    }
+
+    stepMandel(1);
+    resetCounts();
+    resetStats();
+    finishSteps();
+
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    stepMandel(config->bench_steps);
+    finishSteps();
+    result.seconds = secondsSince(start);
+    addKernelTimes(result.kernelTimes);
+
+    // The CPU engine has no events, its wall time stands in for the kernel time
+    if (!opencl) {
+        result.kernelTimes.push_back({"cpuStep", 1e6f * result.seconds, config->bench_steps});
+    }
+
+    fetchStats(&result.iterations, &result.samples, &result.saved);
+    result.increments = sumCounts();
+
+    start = chrono::high_resolution_clock::now();
+    for (unsigned int i = 0; i < config->bench_steps; i++) {
+        renderHeadless();
+    }
+    finishSteps();
+    result.renderSeconds = secondsSince(start);
+    addKernelTimes(result.kernelTimes);
+
+    if (!opencl) {
+        result.kernelTimes.push_back({"cpuRender", 1e6f * result.renderSeconds, config->bench_steps});
+    }
+
+    free(pixelsFW);
+    releaseBackend();
+
+    return result;
+}
+
+void writeJson(const char *filename, vector<BenchResult> &results) {
+    FILE *fp = fopen(filename, "w");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename);
+        return;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"backend\": \"%s\",\n", config->cpu_engine ? "cpu_engine" : (config->use_gpu ? "opencl_gpu" : "opencl_cpu"));
+    fprintf(fp, "  \"particle_count\": %u,\n", config->particle_count);
+    fprintf(fp, "  \"steps\": %u,\n", config->bench_steps);
+    fprintf(fp, "  \"seed\": %u,\n", config->seed);
+    fprintf(fp, "  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        BenchResult &result = results[i];
+        BenchScenario &scenario = result.scenario;
+
+        fprintf(fp, "    {\n");
+        fprintf(fp, "      \"scenario\": \"%s\",\n", scenario.name.c_str());
+        fprintf(fp, "      \"view\": {\"scale\": %g, \"center_x\": %g, \"center_y\": %g, \"theta\": %g, \"width\": %u, \"height\": %u},\n",
+            scenario.view.scale, scenario.view.centerX, scenario.view.centerY, scenario.view.theta, result.width, result.height);
+        fprintf(fp, "      \"path\": \"%s\", \"score\": \"%s\",\n", benchPaths[scenario.pathType].c_str(), benchScores[scenario.scoreType].c_str());
+        fprintf(fp, "      \"histogram\": \"%s\", \"kernel\": \"%s\", \"cross_pollinate\": %s,\n", scenario.localHistogram ? "local" : "global",
+            scenario.persistent ? "persistent" : "step", scenario.crossPollinate ? "true" : "false");
+
+        if (scenario.converge) {
+            fprintf(fp, "      \"converge_seconds\": %.6f, \"converge_steps\": %u, \"converged\": %s,\n",
+                result.convergeSeconds, result.convergeSteps, result.converged ? "true" : "false");
+        }
+
+        fprintf(fp, "      \"seconds\": %.6f, \"render_seconds\": %.6f,\n", result.seconds, result.renderSeconds);
+        fprintf(fp, "      \"iterations\": %llu, \"samples\": %llu, \"increments\": %llu, \"saved_iterations\": %llu,\n",
+            (unsigned long long)result.iterations, (unsigned long long)result.samples, (unsigned long long)result.increments,
+            (unsigned long long)result.saved);
+        fprintf(fp, "      \"iterations_per_second\": %.1f, \"samples_per_second\": %.1f, \"increments_per_second\": %.1f,\n",
+            result.iterations / result.seconds, result.samples / result.seconds, result.increments / result.seconds);
+        fprintf(fp, "      \"kernels\": [");
+
+        for (size_t j = 0; j < result.kernelTimes.size(); j++) {
+            KernelTime &kernelTime = result.kernelTimes[j];
+            fprintf(fp, "%s{\"name\": \"%s\", \"microseconds\": %.1f, \"launches\": %u}", j > 0 ? ", " : "",
+                kernelTime.name.c_str(), kernelTime.time, kernelTime.launches);
+        }
+
+        fprintf(fp, "]\n");
+        fprintf(fp, "    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+
+    fprintf(stderr, "Saved %s\n", filename);
+}
+
+int runBenchmarks() {
+    vector<BenchResult> results;
+    const unsigned int width = config->width;
+    const unsigned int height = config->height;
+
+    // Every scenario starts from the same particles, so runs can be compared across commits
+    if (config->seed == 0) {
+        config->seed = BENCH_SEED;
+    }
+
+    // Kernel event times are only recorded when profiling
+    config->profile = true;
+
+    for (BenchScenario scenario : createScenarios()) {
+        results.push_back(runScenario(scenario, width, height));
+    }
+
+    printf("\n%-22s %-10s %-11s %10s %14s %14s %14s %10s %12s %13s\n",
+        "scenario", "histogram", "kernel", "time (s)", "M iters/s", "k samples/s", "M incs/s", "saved (%)", "render (ms)", "converge (s)");
+
+    for (BenchResult result : results) {
+        // Share of the iterations that would have been needed without cycle detection
+        float saved = result.saved > 0 ? 100. * result.saved / (result.iterations + result.saved) : 0;
+
+        // Marked with a > when the launch limit was hit first
+        char converge[16] = "-";
+        if (result.scenario.converge) {
+            snprintf(converge, sizeof(converge), "%s%.3f", result.converged ? "" : ">", result.convergeSeconds);
+        }
+
+        printf("%-22s %-10s %-11s %10.3f %14.2f %14.2f %14.2f %10.1f %12.2f %13s\n",
+            result.scenario.name.c_str(), result.scenario.localHistogram ? "local" : "global",
+            result.scenario.persistent ? "persistent" : "step", result.seconds,
+            result.iterations / result.seconds / 1e6, result.samples / result.seconds / 1e3,
+            result.increments / result.seconds / 1e6, saved, 1000 * result.renderSeconds / config->bench_steps, converge);
+    }
+
+    writeJson(config->bench_output.c_str(), results);
+
+    return 0;
+}
+
+/**
+ * Checks that resuming from a checkpoint continues the render exactly, run
+ * with ./buddha.out --check-resume or make check-resume. A deterministic
+ * render of bench_steps launches is compared against one that is saved
+ * halfway, torn down and resumed from the checkpoint for the second half.
+ */
+int runResumeCheck() {
+    const size_t size = config->threshold_count * config->width * config->height;
+    const unsigned int steps = max(2u, config->bench_steps);
+    const string checkpointFile = config->checkpoint_file;
+
+    if (config->seed == 0) {
+        config->seed = BENCH_SEED;
+    }
+
+    config->deterministic = true;
+    config->checkpoint_interval = 1;
+    config->checkpoint_file = "resume_check.bin";
+
+    vector<uint32_t> uninterrupted(size);
+    vector<uint32_t> resumed(size);
+
+    prepare();
+    stepMandel(steps / 2);
+    finishSteps();
+    saveCheckpoint();
+    stepMandel(steps - steps / 2);
+    finishSteps();
+    fetchCounts(uninterrupted.data());
+    releaseBackend();
+
+    prepare();
+    bool loaded = resumeCheckpoint();
+    if (loaded) {
+        stepMandel(steps - steps / 2);
+        finishSteps();
+        fetchCounts(resumed.data());
+    }
+    releaseBackend();
+
+    remove(config->checkpoint_file.c_str());
+    config->checkpoint_file = checkpointFile;
+
+    if (!loaded) {
+        fprintf(stderr, "Couldn't resume from the checkpoint\n");
+        return 1;
+    }
+
+    size_t differences = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (uninterrupted[i] != resumed[i]) {
+            differences++;
+        }
+    }
+
+    if (differences > 0) {
+        fprintf(stderr, "Resumed render differs in %zu of %zu counts\n", differences, size);
+        return 1;
+    }
+
+    printf("Resumed render matches the uninterrupted one after %u launches\n", steps);
+
+    return 0;
+}
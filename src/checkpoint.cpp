@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "checkpoint.hpp"
+
+using namespace std;
+
+void allocateCheckpoint(Checkpoint &checkpoint, Config *config) {
+    checkpoint.count.resize(config->threshold_count * config->width * config->height);
+    checkpoint.particles.resize(config->particle_count);
+    checkpoint.randomState.resize(config->particle_count);
+    checkpoint.randomIncrement.resize(config->particle_count);
+}
+
+// The CPU engine always runs PCG streams
+void setHeaderMode(CheckpointHeader &header, Config *config) {
+    header.rngMode = config->counter_rng && !config->cpu_engine ? CHECKPOINT_RNG_COUNTER : CHECKPOINT_RNG_PCG;
+    header.engine = config->cpu_engine ? CHECKPOINT_ENGINE_CPU : CHECKPOINT_ENGINE_OPENCL;
+}
+
+bool matchesConfig(CheckpointHeader &header, Config *config) {
+    CheckpointHeader current;
+    setHeaderMode(current, config);
+
+    if (header.rngMode != current.rngMode || header.engine != current.engine) {
+        return false;
+    }
+
+    if (header.width != config->width || header.height != config->height) {
+        return false;
+    }
+
+    if (header.particleCount != config->particle_count || header.thresholdCount != config->threshold_count) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < config->threshold_count; i++) {
+        if (header.thresholds[i] != config->thresholds[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Dumps can only be added when they cover exactly the same pixels and thresholds
+bool matchesDump(CheckpointHeader &header, CheckpointHeader &other) {
+    if (header.width != other.width || header.height != other.height || header.thresholdCount != other.thresholdCount) {
+        return false;
+    }
+
+    if (header.view.centerX != other.view.centerX || header.view.centerY != other.view.centerY ||
+        header.view.scaleX != other.view.scaleX || header.view.scaleY != other.view.scaleY ||
+        header.view.theta != other.view.theta) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < header.thresholdCount; i++) {
+        if (header.thresholds[i] != other.thresholds[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename T>
+bool writeSection(FILE *fp, vector<T> &section) {
+    return fwrite(section.data(), sizeof(T), section.size(), fp) == section.size();
+}
+
+template <typename T>
+bool readSection(FILE *fp, vector<T> &section) {
+    return fread(section.data(), sizeof(T), section.size(), fp) == section.size();
+}
+
+/**
+ * Writes to a temporary file first so a crash halfway never leaves a
+ * corrupt checkpoint behind.
+ */
+bool writeCheckpoint(const char *filename, Checkpoint &checkpoint) {
+    string tmpName = string(filename) + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open checkpoint %s for writing\n", tmpName.c_str());
+        return false;
+    }
+
+    checkpoint.header.magic = CHECKPOINT_MAGIC;
+    checkpoint.header.version = CHECKPOINT_VERSION;
+
+    bool success = fwrite(&checkpoint.header, sizeof(CheckpointHeader), 1, fp) == 1;
+    success = success && writeSection(fp, checkpoint.count);
+    success = success && writeSection(fp, checkpoint.particles);
+    success = success && writeSection(fp, checkpoint.randomState);
+    success = success && writeSection(fp, checkpoint.randomIncrement);
+
+    fclose(fp);
+
+    if (!success || rename(tmpName.c_str(), filename) != 0) {
+        fprintf(stderr, "Failed to write checkpoint %s\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the header and sizes the sections from it, check matchesConfig before using the result
+bool readCheckpoint(const char *filename, Checkpoint &checkpoint) {
+    FILE *fp = fopen(filename, "rb");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open checkpoint %s\n", filename);
+        return false;
+    }
+
+    CheckpointHeader &header = checkpoint.header;
+
+    if (fread(&header, sizeof(CheckpointHeader), 1, fp) != 1 || header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "%s is not a valid checkpoint\n", filename);
+        fclose(fp);
+        return false;
+    }
+
+    checkpoint.count.resize(header.thresholdCount * header.width * header.height);
+    checkpoint.particles.resize(header.particleCount);
+    checkpoint.randomState.resize(header.particleCount);
+    checkpoint.randomIncrement.resize(header.particleCount);
+
+    bool success = readSection(fp, checkpoint.count);
+    success = success && readSection(fp, checkpoint.particles);
+    success = success && readSection(fp, checkpoint.randomState);
+    success = success && readSection(fp, checkpoint.randomIncrement);
+
+    fclose(fp);
+
+    if (!success) {
+        fprintf(stderr, "Checkpoint %s is truncated\n", filename);
+    }
+
+    return success;
+}
+
+bool writeDump(const char *filename, Checkpoint &checkpoint) {
+    FILE *fp = fopen(filename, "wb");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open dump %s for writing\n", filename);
+        return false;
+    }
+
+    CheckpointHeader header = checkpoint.header;
+    header.magic = DUMP_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+
+    bool success = fwrite(&header, sizeof(CheckpointHeader), 1, fp) == 1;
+    success = success && writeSection(fp, checkpoint.count);
+
+    fclose(fp);
+
+    if (!success) {
+        fprintf(stderr, "Failed to write dump %s\n", filename);
+        return false;
+    }
+
+    fprintf(stderr, "Saved %s\n", filename);
+    return true;
+}
+
+bool readDump(const char *filename, Checkpoint &checkpoint) {
+    FILE *fp = fopen(filename, "rb");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open dump %s\n", filename);
+        return false;
+    }
+
+    CheckpointHeader &header = checkpoint.header;
+
+    if (fread(&header, sizeof(CheckpointHeader), 1, fp) != 1 || header.magic != DUMP_MAGIC || header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "%s is not a valid dump\n", filename);
+        fclose(fp);
+        return false;
+    }
+
+    checkpoint.count.resize(header.thresholdCount * header.width * header.height);
+    bool success = readSection(fp, checkpoint.count);
+
+    fclose(fp);
+
+    if (!success) {
+        fprintf(stderr, "Dump %s is truncated\n", filename);
+    }
+
+    return success;
+}
@@ -57,6 +57,9 @@ void Config::setValue(string name, char *value) {
         case 'f':
             *(float *)setting.pointer = atof(value);
             break;
+        case 's':
+            *(string *)setting.pointer = value;
+            break;
         case 'b':
             if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) {
                 *(bool *)setting.pointer = true;
@@ -92,6 +95,9 @@ void Config::printSetting(string name, Setting setting) {
     case 'f':
         fprintf(stderr, "%s = %.2g\n", name.c_str(), *(float *)setting.pointer);
         break;
+    case 's':
+        fprintf(stderr, "%s = %s\n", name.c_str(), ((string *)setting.pointer)->c_str());
+        break;
     case 'b':
         fprintf(stderr, "%s = %s\n", name.c_str(), *(bool *)setting.pointer ? "true" : "false");
         break;
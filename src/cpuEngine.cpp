@@ -0,0 +1,779 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "coordinates.hpp"
+#include "cpuEngine.hpp"
+#include "cpuSimd.hpp"
+#include "image.hpp"
+#include "pcg.hpp"
+#include "sampleGrid.hpp"
+
+using namespace std;
+
+/**
+ * Mirrors of the constants in shaders/buddha.cl
+ */
+
+const unsigned int STEP_ITERATIONS = 800;
+const unsigned int SUBSTEPS = 5;
+const unsigned int MAX_CONVERGE_STEPS = 500;
+
+typedef struct CpuParticle {
+    FractalCoordinate pos;
+    FractalCoordinate offset, prevOffset;
+    unsigned int iterCount, bestIter;
+    float score, prevScore;
+    float proposalRatio;
+} CpuParticle;
+
+/**
+ * RNG stuff
+ */
+
+inline float uniformRand(pcg32_random_t *rng) {
+    return (float)pcg32_random_r(rng) / (float)PCG_MAX1;
+}
+
+inline float gaussianRand(pcg32_random_t *rng) {
+    return (float)RANDN_r(rng);
+}
+
+/**
+ * Fractal stuff
+ */
+
+inline float distance(FractalCoordinate f1, FractalCoordinate f2) {
+    return sqrt((f1.x - f2.x) * (f1.x - f2.x) + (f1.y - f2.y) * (f1.y - f2.y));
+}
+
+inline bool isValid(FractalCoordinate coord) {
+    float c2 = complex_norm2(coord);
+    float a = coord.x;
+
+    if (c2 >= 4) {
+        return false;
+    }
+
+    // Main bulb
+    if (256.0 * c2 * c2 - 96.0 * c2 + 32.0 * a < 3.0) {
+        return false;
+    }
+
+    // Head
+    if (16.0 * (c2 + 2.0 * a + 1.0) < 1.0) {
+        return false;
+    }
+
+    coord.y = fabs(coord.y);
+
+    // 2-step bulbs
+    if (distance(coord, CENTER_1) < RADIUS_1) {
+        return false;
+    }
+
+    // 3-step bulbs
+    if (distance(coord, CENTER_2) < RADIUS_3) {
+        return false;
+    }
+    if (distance(coord, CENTER_3) < RADIUS_3) {
+        return false;
+    }
+
+    // 4-step bulbs
+    if (distance(coord, CENTER_4) < RADIUS_4) {
+        return false;
+    }
+    if (distance(coord, CENTER_5) < RADIUS_5) {
+        return false;
+    }
+
+    return true;
+}
+
+// Same as getCandidate in the kernel
+inline FractalCoordinate getCandidate(pcg32_random_t *rng, const Sampler &sampler) {
+    FractalCoordinate candidate;
+
+    if (!sampler.cells) {
+        candidate.x = 9. * uniformRand(rng) - 5.2;
+        candidate.y = 6. * uniformRand(rng) - 3.;
+        return candidate;
+    }
+
+    const float cellSize = SAMPLE_GRID_RANGE / sampler.gridSize;
+    const uint32_t cell = sampler.cells[1 + pcg32_random_r(rng) % sampler.cells[0]];
+    const float x = uniformRand(rng);
+    const float y = uniformRand(rng);
+
+    candidate.x = SAMPLE_GRID_MIN + cellSize * (cell % sampler.gridSize + x);
+    candidate.y = SAMPLE_GRID_MIN + cellSize * (cell / sampler.gridSize + y);
+    return candidate;
+}
+
+// Same as getSampleCell in the kernel
+inline int getSampleCell(FractalCoordinate offset, unsigned int gridSize) {
+    const float cellSize = SAMPLE_GRID_RANGE / gridSize;
+    const int x = floor((offset.x - SAMPLE_GRID_MIN) / cellSize);
+    const int y = floor((offset.y - SAMPLE_GRID_MIN) / cellSize);
+
+    if (x < 0 || x >= (int)gridSize || y < 0 || y >= (int)gridSize) {
+        return -1;
+    }
+
+    return y * gridSize + x;
+}
+
+inline float getSampleDensity(const Sampler &sampler, FractalCoordinate offset) {
+    const int cell = getSampleCell(offset, sampler.gridSize);
+
+    return cell < 0 ? SAMPLE_TABLE_SCALE : sampler.density[cell];
+}
+
+// The scores are float bits, like the kernel swaps them in with a compare and exchange
+inline void addImportance(const Sampler &sampler, FractalCoordinate offset, float score) {
+    const int cell = getSampleCell(offset, sampler.gridSize);
+
+    if (cell < 0) {
+        return;
+    }
+
+    uint32_t prev = __atomic_load_n(&sampler.scores[cell], __ATOMIC_RELAXED);
+    uint32_t next;
+
+    do {
+        float sum;
+        memcpy(&sum, &prev, sizeof(float));
+        sum += score;
+        memcpy(&next, &sum, sizeof(float));
+    } while (!__atomic_compare_exchange_n(&sampler.scores[cell], &prev, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Tests a batch of candidates at once, then rewinds the stream to just after
+// the first valid one so the draws match the scalar loop
+inline FractalCoordinate getNewPosSimd(pcg32_random_t *rng, const Sampler &sampler) {
+    const SimdKernels *simd = sampler.simd;
+    FractalCoordinate newOffset;
+    float x[SIMD_MAX_WIDTH], y[SIMD_MAX_WIDTH];
+    pcg32_random_t states[SIMD_MAX_WIDTH];
+
+    for (unsigned int i = 0; i < 51; i += simd->width) {
+        unsigned int tries = min(simd->width, 51 - i);
+
+        for (unsigned int j = 0; j < tries; j++) {
+            FractalCoordinate candidate = getCandidate(rng, sampler);
+            x[j] = candidate.x;
+            y[j] = candidate.y;
+            states[j] = *rng;
+        }
+
+        uint32_t valid = simd->valid(x, y) & ((1u << tries) - 1);
+
+        if (valid) {
+            unsigned int j = __builtin_ctz(valid);
+            *rng = states[j];
+            return {x[j], y[j]};
+        }
+
+        newOffset = {x[tries - 1], y[tries - 1]};
+    }
+
+    return newOffset;
+}
+
+inline FractalCoordinate getNewPos(pcg32_random_t *rng, const Sampler &sampler) {
+    if (sampler.simd) {
+        return getNewPosSimd(rng, sampler);
+    }
+
+    FractalCoordinate newOffset;
+
+    for (int i = 0; i < 51; i++) {
+        newOffset = getCandidate(rng, sampler);
+
+        if (isValid(newOffset)) {
+            break;
+        }
+    }
+
+    return newOffset;
+}
+
+// Same transform as fractalToPixel in the kernel, returns false outside the view
+inline bool getPixelIndex(FractalCoordinate coord, const ViewSettings &view, unsigned int *index) {
+    float dx = coord.x - view.centerX;
+    float dy = coord.y - view.centerY;
+
+    int x = (1 + (view.cosTheta * dx - view.sinTheta * dy) / view.scaleX) / 2 * view.sizeX;
+    int y = (1 + (view.sinTheta * dx + view.cosTheta * dy) / view.scaleY) / 2 * view.sizeY;
+
+    if (x < 0 || x >= view.sizeX || y < 0 || y >= view.sizeY) {
+        return false;
+    }
+
+    *index = view.sizeX * y + x;
+    return true;
+}
+
+inline int matchThreshold(CpuParticle &particle, Config *config) {
+    for (unsigned int i = 0; i < config->threshold_count; i++) {
+        if (particle.iterCount <= config->thresholds[i]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+inline void resetParticle(CpuParticle &particle, pcg32_random_t *rng, const Sampler &sampler) {
+    FractalCoordinate newOffset = getNewPos(rng, sampler);
+
+    particle.iterCount = 1;
+    particle.bestIter = 1;
+    particle.pos = newOffset;
+    particle.offset = newOffset;
+    particle.prevOffset = newOffset;
+    particle.score = 0;
+    particle.prevScore = 0;
+    particle.proposalRatio = 1;
+}
+
+// The orbit is replayed from the offset instead of read back from a path buffer
+inline int getScore(CpuParticle &particle, const ViewSettings &view) {
+    int score = 0;
+    unsigned int index;
+    FractalCoordinate z = particle.offset;
+
+    for (unsigned int i = 0; i < particle.iterCount; i++) {
+        score += getPixelIndex(z, view, &index);
+        score += getPixelIndex({z.x, -z.y}, view, &index);
+
+        z = complex_square(z) + particle.offset;
+    }
+
+    return score;
+}
+
+inline float getDeltaScore(int pathType, uint32_t pixelCount) {
+    switch (pathType) {
+        default:
+        case (PathOptions::PATH_CONSTANT):
+            return 1;
+        case (PathOptions::PATH_SQRT):
+            return 1. / (1 + pixelCount);
+        case (PathOptions::PATH_LINEAR):
+            return 1. / (1 + sqrt(1. + pixelCount));
+        case (PathOptions::PATH_SQUARE):
+            return 1. / (1 + pow((float)pixelCount, 2));
+    }
+}
+
+// snapshot is only set in deterministic mode, see DETERMINISTIC in the kernel
+inline void splat(CpuParticle &particle, uint32_t *count, const uint32_t *snapshot, FractalCoordinate z, int pathType, const ViewSettings &view) {
+    unsigned int index;
+
+    if (getPixelIndex(z, view, &index)) {
+        uint32_t pixelCount = __atomic_add_fetch(&count[index], 1, __ATOMIC_RELAXED);
+        particle.score += getDeltaScore(pathType, snapshot ? snapshot[index] : pixelCount);
+    }
+}
+
+inline void addPath(CpuParticle &particle, uint32_t *count, const uint32_t *snapshot, int pathType, const ViewSettings &view) {
+    FractalCoordinate z = particle.offset;
+
+    for (unsigned int i = 0; i < particle.iterCount; i++) {
+        splat(particle, count, snapshot, z, pathType, view);
+        splat(particle, count, snapshot, {z.x, -z.y}, pathType, view);
+
+        z = complex_square(z) + particle.offset;
+    }
+}
+
+inline void applyScore(CpuParticle &particle, int scoreType, unsigned int threshold) {
+    switch (scoreType) {
+        default:
+        case (ScoreOptions::SCORE_NONE):
+            break;
+        case (ScoreOptions::SCORE_SQRT):
+            particle.score = sqrt(particle.score);
+            break;
+        case (ScoreOptions::SCORE_SQUARE):
+            particle.score = pow(particle.score, 2);
+            break;
+        case (ScoreOptions::SCORE_NORM):
+            particle.score = particle.score / threshold;
+            break;
+        case (ScoreOptions::SCORE_SQNORM):
+            particle.score = pow(particle.score, 2) / threshold;
+            break;
+    }
+}
+
+inline float getRange(unsigned int iterCount) {
+    return clamp(17.f / (1 + iterCount), 1e-5f, 0.1f);
+}
+
+// Same as getPoolEntry in the kernel
+inline bool getPoolEntry(const PoolEntry *pool, float prevScore, pcg32_random_t *rng, PoolEntry &entry) {
+    entry = pool[pcg32_random_r(rng) % POOL_SIZE];
+    const float threshold = (entry.score / (prevScore + 1) - 5) * 0.2f;
+
+    return uniformRand(rng) < threshold;
+}
+
+// pool is NULL unless cross-pollination is on
+inline void mutateParticle(CpuParticle &particle, pcg32_random_t *rng, const ViewSettings &view, const Sampler &sampler, const PoolEntry *pool) {
+    if (sampler.scores && particle.score > 0) {
+        addImportance(sampler, particle.offset, particle.score);
+    }
+
+    const float score = particle.score * particle.proposalRatio;
+
+    if (score >= particle.prevScore || score / particle.prevScore > uniformRand(rng)) {
+        particle.prevScore = particle.score;
+        particle.prevOffset = particle.offset;
+        particle.bestIter = particle.iterCount;
+    }
+
+    FractalCoordinate newOffset;
+    PoolEntry entry;
+    particle.proposalRatio = 1;
+
+    if (uniformRand(rng) < 0.98) {
+        float range = getRange(particle.iterCount);
+
+        newOffset.x = particle.prevOffset.x + range * view.scaleY * clamp(gaussianRand(rng), -5.f, 5.f);
+        newOffset.y = particle.prevOffset.y + range * view.scaleY * clamp(gaussianRand(rng), -5.f, 5.f);
+    } else if (pool && getPoolEntry(pool, particle.prevScore, rng, entry)) {
+        // Biased on purpose, proposalRatio stays 1, see updatePool in the kernel
+        float range = getRange(entry.iterCount);
+
+        newOffset.x = entry.offset.x + range * view.scaleY * clamp(gaussianRand(rng), -5.f, 5.f);
+        newOffset.y = entry.offset.y + range * view.scaleY * clamp(gaussianRand(rng), -5.f, 5.f);
+    } else {
+        newOffset = getNewPos(rng, sampler);
+
+        if (sampler.density) {
+            particle.proposalRatio = getSampleDensity(sampler, particle.prevOffset) / getSampleDensity(sampler, newOffset);
+        }
+    }
+
+    particle.pos = newOffset;
+    particle.offset = newOffset;
+    particle.iterCount = 1;
+    particle.score = 0;
+}
+
+inline CpuParticle loadParticle(Particle &particle) {
+    return {
+        {particle.pos.s[0], particle.pos.s[1]},
+        {particle.offset.s[0], particle.offset.s[1]},
+        {particle.prevOffset.s[0], particle.prevOffset.s[1]},
+        particle.iterCount, particle.bestIter,
+        particle.score, particle.prevScore,
+        particle.proposalRatio
+    };
+}
+
+inline void storeParticle(CpuParticle &tmp, Particle &particle) {
+    particle.pos.s[0] = tmp.pos.x;
+    particle.pos.s[1] = tmp.pos.y;
+    particle.offset.s[0] = tmp.offset.x;
+    particle.offset.s[1] = tmp.offset.y;
+    particle.prevOffset.s[0] = tmp.prevOffset.x;
+    particle.prevOffset.s[1] = tmp.prevOffset.y;
+    particle.iterCount = tmp.iterCount;
+    particle.bestIter = tmp.bestIter;
+    particle.score = tmp.score;
+    particle.prevScore = tmp.prevScore;
+    particle.proposalRatio = tmp.proposalRatio;
+}
+
+/**
+ * Engine
+ */
+
+CpuEngine::CpuEngine(Config *config, unsigned int threadCount) {
+    this->config = config;
+    this->threadCount = threadCount > 0 ? threadCount : max(1u, thread::hardware_concurrency());
+
+    pixelCount = config->width * config->height;
+
+    count.resize(config->threshold_count * pixelCount);
+    prevCount.resize(config->threshold_count * pixelCount);
+    countDiff.resize(config->threshold_count * pixelCount);
+    particles.resize(config->particle_count);
+    randomState.resize(config->particle_count);
+    pool.resize(POOL_SIZE, {{0, 0}, 1, 0});
+    resetStats();
+
+    if (config->cpu_simd) {
+        simd = getSimdKernels();
+    }
+    sampler = {simd, NULL, 0, NULL, NULL};
+
+    for (unsigned int i = 0; i < this->threadCount; i++) {
+        workers.push_back(thread(&CpuEngine::workerLoop, this, i));
+    }
+
+    if (config->verbose) {
+        fprintf(stderr, "CPU engine running on %d threads, %s\n", this->threadCount, simd ? simd->name : "scalar");
+    }
+}
+
+CpuEngine::~CpuEngine() {
+    {
+        lock_guard<mutex> lock(workerMutex);
+        stopping = true;
+    }
+    workerWake.notify_all();
+
+    for (thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// Draws the per-particle streams from the global generator, like initPcg does for the kernels
+void CpuEngine::seed() {
+    for (size_t i = 0; i < randomState.size(); i++) {
+        uint64_t initState = pcg32_random();
+        uint64_t initSeq = pcg32_random();
+
+        pcg32_srandom_r(&randomState[i], initState, initSeq);
+    }
+}
+
+// The list from buildSampleCells, or the map from createImportanceMap with
+// importance_map on. An empty one draws from the whole sampling rectangle
+void CpuEngine::setSampleCells(const vector<uint32_t> &cells) {
+    sampleCells = cells;
+    sampler.cells = sampleCells.empty() ? NULL : sampleCells.data();
+    sampler.gridSize = config->sample_grid;
+    sampler.density = NULL;
+    sampler.scores = NULL;
+
+    // The map has its sections after the table
+    if (!sampleCells.empty() && sampleCells.size() > 1 + sampleCells[0]) {
+        sampler.density = &sampleCells[1 + sampleCells[0]];
+        sampler.scores = &sampleCells[1 + sampleCells[0] + sampler.gridSize * sampler.gridSize];
+    }
+}
+
+void CpuEngine::setView(ViewSettings view) {
+    this->view = view;
+}
+
+void CpuEngine::resetCount() {
+    fill(count.begin(), count.end(), 0);
+}
+
+void CpuEngine::resetStats() {
+    iterationCount = 0;
+    sampleCount = 0;
+    savedCount = 0;
+}
+
+void CpuEngine::initParticles() {
+    runWorkers(particles.size(), [this](size_t begin, size_t end) {
+        for (size_t x = begin; x < end; x++) {
+            CpuParticle tmp;
+            resetParticle(tmp, &randomState[x], sampler);
+            storeParticle(tmp, particles[x]);
+        }
+    });
+}
+
+// Same as updatePool in the kernel, has to run between steps
+void CpuEngine::updatePool() {
+    for (unsigned int x = 0; x < POOL_SIZE; x++) {
+        PoolEntry best = {{0, 0}, 1, 0};
+
+        for (size_t i = x; i < particles.size(); i += POOL_SIZE) {
+            if (particles[i].prevScore > best.score) {
+                best = {{particles[i].prevOffset.s[0], particles[i].prevOffset.s[1]}, particles[i].bestIter, particles[i].prevScore};
+            }
+        }
+
+        pool[x] = best;
+    }
+}
+
+void CpuEngine::step(int pathType, int scoreType, int count) {
+    if (config->deterministic) {
+        // The workers have to sync after every step to refresh the snapshot
+        for (int i = 0; i < count; i++) {
+            snapshot = this->count;
+
+            runWorkers(particles.size(), [this, pathType, scoreType](size_t begin, size_t end) {
+                stepRange(begin, end, pathType, scoreType);
+            });
+        }
+
+        return;
+    }
+
+    runWorkers(particles.size(), [this, pathType, scoreType, count](size_t begin, size_t end) {
+        for (int i = 0; i < count; i++) {
+            stepRange(begin, end, pathType, scoreType);
+        }
+    });
+}
+
+void CpuEngine::stepRange(size_t begin, size_t end, int pathType, int scoreType) {
+    StepCounts counts = {0, 0, 0};
+
+    if (!simd) {
+        for (size_t x = begin; x < end; x++) {
+            stepParticle(x, pathType, scoreType, counts);
+        }
+    } else {
+        for (size_t x = begin; x < end; x += simd->width) {
+            stepLanes(x, min(end, x + simd->width), pathType, scoreType, counts);
+        }
+    }
+
+    iterationCount += counts.iterations;
+    sampleCount += counts.samples;
+    savedCount += counts.saved;
+}
+
+// Equivalent of a single work-item in MANDEL_DEF
+void CpuEngine::stepParticle(size_t x, int pathType, int scoreType, StepCounts &counts) {
+    pcg32_random_t *rng = &randomState[x];
+
+    CpuParticle tmp = loadParticle(particles[x]);
+    CycleState cycle = {tmp.offset, tmp.pos, 1, 0};
+    uint64_t samples = 0, saved = 0;
+
+    for (unsigned int i = 0; i < STEP_ITERATIONS; i++) {
+        for (unsigned int j = 0; j < SUBSTEPS; j++) {
+            tmp.pos = complex_square(tmp.pos) + tmp.offset;
+        }
+        tmp.iterCount += SUBSTEPS;
+
+        samples += updateParticle(tmp, cycle, rng, pathType, scoreType, saved);
+    }
+
+    storeParticle(tmp, particles[x]);
+
+    counts.iterations += STEP_ITERATIONS * SUBSTEPS;
+    counts.samples += samples;
+    counts.saved += saved;
+}
+
+// Same as cycleFound in the kernel
+inline bool cycleFound(CpuParticle &particle, CycleState &cycle, float tolerance) {
+    if (particle.offset.x != cycle.offset.x || particle.offset.y != cycle.offset.y) {
+        cycle = {particle.offset, particle.pos, 1, 0};
+        return false;
+    }
+
+    if (fabs(particle.pos.x - cycle.ref.x) <= tolerance && fabs(particle.pos.y - cycle.ref.y) <= tolerance) {
+        return true;
+    }
+
+    if (++cycle.length == cycle.power) {
+        cycle.ref = particle.pos;
+        cycle.power *= 2;
+        cycle.length = 0;
+    }
+
+    return false;
+}
+
+// Everything that follows the substeps, returns whether the orbit was sampled
+bool CpuEngine::updateParticle(CpuParticle &tmp, CycleState &cycle, pcg32_random_t *rng, int pathType, int scoreType, uint64_t &saved) {
+    const unsigned int maxLength = config->thresholds[config->threshold_count - 1];
+    bool escaped = fabs(tmp.pos.x) > 4 || fabs(tmp.pos.y) > 4 || complex_norm2(tmp.pos) > 16;
+
+    if (tmp.prevScore < 10 && (tmp.iterCount > MAX_CONVERGE_STEPS || escaped)) {
+        tmp.prevScore = getScore(tmp, view);
+        if (tmp.prevScore < 10) {
+            tmp.prevOffset = tmp.offset;
+            tmp.pos = getNewPos(rng, sampler);
+            tmp.offset = tmp.pos;
+            tmp.iterCount = 1;
+            tmp.score = 0;
+            tmp.proposalRatio = 1;
+        }
+    }
+
+    if (escaped) {
+        int thresholdIndex = matchThreshold(tmp, config);
+
+        if (thresholdIndex >= 0) {
+            const uint32_t *layerSnapshot = config->deterministic ? &snapshot[thresholdIndex * pixelCount] : NULL;
+            addPath(tmp, &count[thresholdIndex * pixelCount], layerSnapshot, pathType, view);
+            applyScore(tmp, scoreType, config->thresholds[thresholdIndex]);
+        }
+
+        mutateParticle(tmp, rng, view, sampler, crossPollinate ? pool.data() : NULL);
+        return true;
+    } else if (tmp.iterCount >= maxLength || (config->cycle_detection && cycleFound(tmp, cycle, config->cycle_tolerance))) {
+        saved += tmp.iterCount < maxLength ? maxLength - tmp.iterCount : 0;
+        resetParticle(tmp, rng, sampler);
+    }
+
+    return false;
+}
+
+// Lanes past the end of the group are parked at the origin and left out of active
+inline void setLane(SimdLanes &lanes, unsigned int lane, CpuParticle *particle, CycleState *cycle, unsigned int maxLength) {
+    lanes.posX[lane] = particle ? particle->pos.x : 0;
+    lanes.posY[lane] = particle ? particle->pos.y : 0;
+    lanes.offsetX[lane] = particle ? particle->offset.x : 0;
+    lanes.offsetY[lane] = particle ? particle->offset.y : 0;
+    lanes.iterCount[lane] = particle ? particle->iterCount : 0;
+
+    lanes.cycleOffsetX[lane] = cycle ? cycle->offset.x : 0;
+    lanes.cycleOffsetY[lane] = cycle ? cycle->offset.y : 0;
+    lanes.cycleRefX[lane] = cycle ? cycle->ref.x : 0;
+    lanes.cycleRefY[lane] = cycle ? cycle->ref.y : 0;
+    lanes.cyclePower[lane] = cycle ? cycle->power : 1;
+    lanes.cycleLength[lane] = cycle ? cycle->length : 0;
+
+    // First iterCount at which updateParticle can do anything besides an escape or a cycle reset
+    if (!particle) {
+        lanes.iterLimit[lane] = INT32_MAX;
+    } else if (particle->prevScore < 10) {
+        lanes.iterLimit[lane] = min(MAX_CONVERGE_STEPS + 1, maxLength);
+    } else {
+        lanes.iterLimit[lane] = maxLength;
+    }
+}
+
+inline void getLane(SimdLanes &lanes, unsigned int lane, CpuParticle &particle, CycleState &cycle) {
+    particle.pos = {lanes.posX[lane], lanes.posY[lane]};
+    particle.iterCount = lanes.iterCount[lane];
+
+    cycle.offset = {lanes.cycleOffsetX[lane], lanes.cycleOffsetY[lane]};
+    cycle.ref = {lanes.cycleRefX[lane], lanes.cycleRefY[lane]};
+    cycle.power = lanes.cyclePower[lane];
+    cycle.length = lanes.cycleLength[lane];
+}
+
+// Same as stepParticle for a group of up to simd->width particles run in
+// lockstep. A lane only leaves the vector loop for the step in which it
+// escapes, closes a cycle or reaches its iteration limit, the other lanes
+// wait for it.
+void CpuEngine::stepLanes(size_t begin, size_t end, int pathType, int scoreType, StepCounts &counts) {
+    const unsigned int maxLength = config->thresholds[config->threshold_count - 1];
+    const unsigned int width = end - begin;
+    const float tolerance = config->cycle_detection ? config->cycle_tolerance : -1;
+
+    CpuParticle tmp[SIMD_MAX_WIDTH];
+    CycleState cycles[SIMD_MAX_WIDTH];
+    SimdLanes lanes;
+    uint64_t samples = 0, saved = 0;
+
+    for (unsigned int lane = 0; lane < simd->width; lane++) {
+        if (lane < width) {
+            tmp[lane] = loadParticle(particles[begin + lane]);
+            cycles[lane] = {tmp[lane].offset, tmp[lane].pos, 1, 0};
+            setLane(lanes, lane, &tmp[lane], &cycles[lane], maxLength);
+        } else {
+            setLane(lanes, lane, NULL, NULL, maxLength);
+        }
+    }
+    lanes.active = (1u << width) - 1;
+
+    for (unsigned int i = 0; i < STEP_ITERATIONS;) {
+        uint32_t events;
+        i += simd->iterate(lanes, SUBSTEPS, STEP_ITERATIONS - i, tolerance, &events);
+
+        for (; events; events &= events - 1) {
+            unsigned int lane = __builtin_ctz(events);
+
+            getLane(lanes, lane, tmp[lane], cycles[lane]);
+            samples += updateParticle(tmp[lane], cycles[lane], &randomState[begin + lane], pathType, scoreType, saved);
+            setLane(lanes, lane, &tmp[lane], &cycles[lane], maxLength);
+        }
+    }
+
+    for (unsigned int lane = 0; lane < width; lane++) {
+        getLane(lanes, lane, tmp[lane], cycles[lane]);
+        storeParticle(tmp[lane], particles[begin + lane]);
+    }
+
+    counts.iterations += width * STEP_ITERATIONS * SUBSTEPS;
+    counts.samples += samples;
+    counts.saved += saved;
+}
+
+void CpuEngine::updateDiff(float alpha) {
+    runWorkers(count.size(), [this, alpha](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            countDiff[i] = countDiff[i] * alpha + (float)count[i] - (float)prevCount[i];
+            prevCount[i] = count[i];
+        }
+    });
+}
+
+void CpuEngine::findMax(bool diff, uint32_t *maximum) {
+    const uint32_t *source = diff ? countDiff.data() : count.data();
+
+    for (unsigned int i = 0; i < config->threshold_count; i++) {
+        maximum[i] = *max_element(source + i * pixelCount, source + (i + 1) * pixelCount);
+    }
+}
+
+void CpuEngine::renderImage(bool diff, uint32_t *maximum, uint32_t *image) {
+    const uint32_t *source = diff ? countDiff.data() : count.data();
+
+    runWorkers(pixelCount, [this, source, maximum, image](size_t begin, size_t end) {
+        renderCounts(source, maximum, config->threshold_count, pixelCount, image, begin, end, config->output_bits);
+    });
+}
+
+void CpuEngine::readParticles(Particle *target) {
+    copy(particles.begin(), particles.end(), target);
+}
+
+// Hands work to every worker and blocks until all of them are done with their slice
+void CpuEngine::runWorkers(size_t size, function<void(size_t, size_t)> work) {
+    unique_lock<mutex> lock(workerMutex);
+
+    job = work;
+    jobSize = size;
+    jobsLeft = threadCount;
+    jobGeneration++;
+    workerWake.notify_all();
+
+    workerDone.wait(lock, [this]() { return jobsLeft == 0; });
+    job = nullptr;
+}
+
+// Worker index always gets the same slice, so it keeps touching the same particles
+void CpuEngine::workerLoop(unsigned int index) {
+    uint64_t generation = 0;
+    unique_lock<mutex> lock(workerMutex);
+
+    while (true) {
+        workerWake.wait(lock, [this, generation]() { return stopping || jobGeneration != generation; });
+
+        if (stopping) {
+            return;
+        }
+
+        generation = jobGeneration;
+        size_t chunk = (jobSize + threadCount - 1) / threadCount;
+        size_t begin = min(jobSize, index * chunk);
+        size_t end = min(jobSize, begin + chunk);
+        function<void(size_t, size_t)> &work = job;
+
+        lock.unlock();
+        if (begin < end) {
+            work(begin, end);
+        }
+        lock.lock();
+
+        if (--jobsLeft == 0) {
+            workerDone.notify_one();
+        }
+    }
+}
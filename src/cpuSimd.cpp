@@ -0,0 +1,301 @@
+#include "cpuSimd.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// AVX-512 implies FMA, fusing the multiplies would break parity with the scalar loop
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+/**
+ * AVX2, 8 lanes
+ */
+
+__attribute__((target("avx2")))
+static inline __m256 bulbAvx2(__m256 x, __m256 y, FractalCoordinate center, float radius) {
+    __m256 dx = _mm256_sub_ps(x, _mm256_set1_ps(center.x));
+    __m256 dy = _mm256_sub_ps(y, _mm256_set1_ps(center.y));
+    __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+
+    return _mm256_cmp_ps(distance, _mm256_set1_ps(radius), _CMP_LT_OQ);
+}
+
+// The cardioid and head tests are done in double like in isValid
+__attribute__((target("avx2")))
+static inline int cardioidAvx2(__m128 c2f, __m128 af) {
+    __m256d c2 = _mm256_cvtps_pd(c2f);
+    __m256d a = _mm256_cvtps_pd(af);
+
+    __m256d bulb = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(256.0), c2), c2),
+        _mm256_mul_pd(_mm256_set1_pd(96.0), c2)), _mm256_mul_pd(_mm256_set1_pd(32.0), a));
+    __m256d head = _mm256_mul_pd(_mm256_set1_pd(16.0),
+        _mm256_add_pd(_mm256_add_pd(c2, _mm256_mul_pd(_mm256_set1_pd(2.0), a)), _mm256_set1_pd(1.0)));
+
+    return _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(bulb, _mm256_set1_pd(3.0), _CMP_LT_OQ),
+        _mm256_cmp_pd(head, _mm256_set1_pd(1.0), _CMP_LT_OQ)));
+}
+
+__attribute__((target("avx2")))
+static uint32_t validAvx2(const float *px, const float *py) {
+    __m256 x = _mm256_loadu_ps(px);
+    __m256 y = _mm256_loadu_ps(py);
+    __m256 c2 = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+
+    __m256 reject = _mm256_cmp_ps(c2, _mm256_set1_ps(4), _CMP_GE_OQ);
+
+    y = _mm256_andnot_ps(_mm256_set1_ps(-0.f), y);
+    reject = _mm256_or_ps(reject, bulbAvx2(x, y, CENTER_1, RADIUS_1));
+    reject = _mm256_or_ps(reject, bulbAvx2(x, y, CENTER_2, RADIUS_3));
+    reject = _mm256_or_ps(reject, bulbAvx2(x, y, CENTER_3, RADIUS_3));
+    reject = _mm256_or_ps(reject, bulbAvx2(x, y, CENTER_4, RADIUS_4));
+    reject = _mm256_or_ps(reject, bulbAvx2(x, y, CENTER_5, RADIUS_5));
+
+    uint32_t rejected = _mm256_movemask_ps(reject);
+    rejected |= cardioidAvx2(_mm256_castps256_ps128(c2), _mm256_castps256_ps128(x));
+    rejected |= cardioidAvx2(_mm256_extractf128_ps(c2, 1), _mm256_extractf128_ps(x, 1)) << 4;
+
+    return ~rejected & 0xff;
+}
+
+__attribute__((target("avx2")))
+static unsigned int iterateAvx2(SimdLanes &lanes, unsigned int substeps, unsigned int maxSteps, float tolerance, uint32_t *events) {
+    __m256 x = _mm256_load_ps(lanes.posX);
+    __m256 y = _mm256_load_ps(lanes.posY);
+    const __m256 offsetX = _mm256_load_ps(lanes.offsetX);
+    const __m256 offsetY = _mm256_load_ps(lanes.offsetY);
+    __m256i iterCount = _mm256_load_si256((__m256i *)lanes.iterCount);
+    const __m256i iterLimit = _mm256_sub_epi32(_mm256_load_si256((__m256i *)lanes.iterLimit), _mm256_set1_epi32(1));
+
+    __m256 cycleOffsetX = _mm256_load_ps(lanes.cycleOffsetX);
+    __m256 cycleOffsetY = _mm256_load_ps(lanes.cycleOffsetY);
+    __m256 cycleRefX = _mm256_load_ps(lanes.cycleRefX);
+    __m256 cycleRefY = _mm256_load_ps(lanes.cycleRefY);
+    __m256i cyclePower = _mm256_load_si256((__m256i *)lanes.cyclePower);
+    __m256i cycleLength = _mm256_load_si256((__m256i *)lanes.cycleLength);
+
+    // Lanes that moved to a new offset, the offsets are fixed inside the loop
+    __m256 restart = _mm256_or_ps(_mm256_cmp_ps(offsetX, cycleOffsetX, _CMP_NEQ_UQ), _mm256_cmp_ps(offsetY, cycleOffsetY, _CMP_NEQ_UQ));
+
+    const __m256i increment = _mm256_set1_epi32(substeps);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    const __m256 two = _mm256_set1_ps(2);
+    const __m256 four = _mm256_set1_ps(4);
+    const __m256 sixteen = _mm256_set1_ps(16);
+    const __m256 cycleTolerance = _mm256_set1_ps(tolerance);
+
+    unsigned int steps = 0;
+    int mask = 0;
+
+    while (mask == 0 && steps < maxSteps) {
+        for (unsigned int j = 0; j < substeps; j++) {
+            __m256 xy = _mm256_mul_ps(_mm256_mul_ps(two, x), y);
+            x = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), offsetX);
+            y = _mm256_add_ps(xy, offsetY);
+        }
+        iterCount = _mm256_add_epi32(iterCount, increment);
+        steps++;
+
+        __m256 escaped = _mm256_or_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, x), four, _CMP_GT_OQ),
+            _mm256_cmp_ps(_mm256_andnot_ps(sign, y), four, _CMP_GT_OQ));
+        escaped = _mm256_or_ps(escaped,
+            _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), sixteen, _CMP_GT_OQ));
+        __m256i reached = _mm256_cmpgt_epi32(iterCount, iterLimit);
+
+        __m256 cycled = _mm256_and_ps(
+            _mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(x, cycleRefX)), cycleTolerance, _CMP_LE_OQ),
+            _mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(y, cycleRefY)), cycleTolerance, _CMP_LE_OQ));
+        cycled = _mm256_andnot_ps(restart, cycled);
+
+        __m256 event = _mm256_or_ps(_mm256_or_ps(escaped, cycled), _mm256_castsi256_ps(reached));
+        mask = _mm256_movemask_ps(event) & lanes.active;
+
+        // Brent's bookkeeping for the lanes that carry on
+        __m256i length = _mm256_add_epi32(cycleLength, one);
+        __m256 refresh = _mm256_or_ps(restart, _mm256_castsi256_ps(_mm256_cmpeq_epi32(length, cyclePower)));
+        refresh = _mm256_andnot_ps(event, refresh);
+        __m256 reset = _mm256_andnot_ps(event, restart);
+
+        cyclePower = _mm256_blendv_epi8(cyclePower, _mm256_slli_epi32(cyclePower, 1), _mm256_castps_si256(refresh));
+        cyclePower = _mm256_blendv_epi8(cyclePower, one, _mm256_castps_si256(reset));
+        length = _mm256_andnot_si256(_mm256_castps_si256(refresh), length);
+        cycleLength = _mm256_blendv_epi8(length, cycleLength, _mm256_castps_si256(event));
+        cycleRefX = _mm256_blendv_ps(cycleRefX, x, refresh);
+        cycleRefY = _mm256_blendv_ps(cycleRefY, y, refresh);
+        cycleOffsetX = _mm256_blendv_ps(offsetX, cycleOffsetX, event);
+        cycleOffsetY = _mm256_blendv_ps(offsetY, cycleOffsetY, event);
+        restart = _mm256_and_ps(event, restart);
+    }
+
+    _mm256_store_ps(lanes.posX, x);
+    _mm256_store_ps(lanes.posY, y);
+    _mm256_store_si256((__m256i *)lanes.iterCount, iterCount);
+
+    _mm256_store_ps(lanes.cycleOffsetX, cycleOffsetX);
+    _mm256_store_ps(lanes.cycleOffsetY, cycleOffsetY);
+    _mm256_store_ps(lanes.cycleRefX, cycleRefX);
+    _mm256_store_ps(lanes.cycleRefY, cycleRefY);
+    _mm256_store_si256((__m256i *)lanes.cyclePower, cyclePower);
+    _mm256_store_si256((__m256i *)lanes.cycleLength, cycleLength);
+
+    *events = mask;
+    return steps;
+}
+
+/**
+ * AVX-512, 16 lanes
+ */
+
+__attribute__((target("avx512f")))
+static inline __mmask16 bulbAvx512(__m512 x, __m512 y, FractalCoordinate center, float radius) {
+    __m512 dx = _mm512_sub_ps(x, _mm512_set1_ps(center.x));
+    __m512 dy = _mm512_sub_ps(y, _mm512_set1_ps(center.y));
+    __m512 distance = _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)));
+
+    return _mm512_cmp_ps_mask(distance, _mm512_set1_ps(radius), _CMP_LT_OQ);
+}
+
+__attribute__((target("avx512f")))
+static inline __mmask8 cardioidAvx512(__m256 c2f, __m256 af) {
+    __m512d c2 = _mm512_cvtps_pd(c2f);
+    __m512d a = _mm512_cvtps_pd(af);
+
+    __m512d bulb = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(256.0), c2), c2),
+        _mm512_mul_pd(_mm512_set1_pd(96.0), c2)), _mm512_mul_pd(_mm512_set1_pd(32.0), a));
+    __m512d head = _mm512_mul_pd(_mm512_set1_pd(16.0),
+        _mm512_add_pd(_mm512_add_pd(c2, _mm512_mul_pd(_mm512_set1_pd(2.0), a)), _mm512_set1_pd(1.0)));
+
+    return _mm512_cmp_pd_mask(bulb, _mm512_set1_pd(3.0), _CMP_LT_OQ) | _mm512_cmp_pd_mask(head, _mm512_set1_pd(1.0), _CMP_LT_OQ);
+}
+
+__attribute__((target("avx512f")))
+static inline __m256 upperHalf(__m512 v) {
+    return _mm256_castsi256_ps(_mm512_extracti64x4_epi64(_mm512_castps_si512(v), 1));
+}
+
+__attribute__((target("avx512f")))
+static uint32_t validAvx512(const float *px, const float *py) {
+    __m512 x = _mm512_loadu_ps(px);
+    __m512 y = _mm512_loadu_ps(py);
+    __m512 c2 = _mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y));
+
+    __mmask16 reject = _mm512_cmp_ps_mask(c2, _mm512_set1_ps(4), _CMP_GE_OQ);
+
+    y = _mm512_abs_ps(y);
+    reject |= bulbAvx512(x, y, CENTER_1, RADIUS_1);
+    reject |= bulbAvx512(x, y, CENTER_2, RADIUS_3);
+    reject |= bulbAvx512(x, y, CENTER_3, RADIUS_3);
+    reject |= bulbAvx512(x, y, CENTER_4, RADIUS_4);
+    reject |= bulbAvx512(x, y, CENTER_5, RADIUS_5);
+
+    uint32_t rejected = reject;
+    rejected |= cardioidAvx512(_mm512_castps512_ps256(c2), _mm512_castps512_ps256(x));
+    rejected |= (uint32_t)cardioidAvx512(upperHalf(c2), upperHalf(x)) << 8;
+
+    return ~rejected & 0xffff;
+}
+
+__attribute__((target("avx512f")))
+static unsigned int iterateAvx512(SimdLanes &lanes, unsigned int substeps, unsigned int maxSteps, float tolerance, uint32_t *events) {
+    __m512 x = _mm512_load_ps(lanes.posX);
+    __m512 y = _mm512_load_ps(lanes.posY);
+    const __m512 offsetX = _mm512_load_ps(lanes.offsetX);
+    const __m512 offsetY = _mm512_load_ps(lanes.offsetY);
+    __m512i iterCount = _mm512_load_si512(lanes.iterCount);
+    const __m512i iterLimit = _mm512_load_si512(lanes.iterLimit);
+
+    __m512 cycleOffsetX = _mm512_load_ps(lanes.cycleOffsetX);
+    __m512 cycleOffsetY = _mm512_load_ps(lanes.cycleOffsetY);
+    __m512 cycleRefX = _mm512_load_ps(lanes.cycleRefX);
+    __m512 cycleRefY = _mm512_load_ps(lanes.cycleRefY);
+    __m512i cyclePower = _mm512_load_si512(lanes.cyclePower);
+    __m512i cycleLength = _mm512_load_si512(lanes.cycleLength);
+
+    // Lanes that moved to a new offset, the offsets are fixed inside the loop
+    __mmask16 restart = _mm512_cmp_ps_mask(offsetX, cycleOffsetX, _CMP_NEQ_UQ) | _mm512_cmp_ps_mask(offsetY, cycleOffsetY, _CMP_NEQ_UQ);
+
+    const __m512i increment = _mm512_set1_epi32(substeps);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512 two = _mm512_set1_ps(2);
+    const __m512 four = _mm512_set1_ps(4);
+    const __m512 sixteen = _mm512_set1_ps(16);
+    const __m512 cycleTolerance = _mm512_set1_ps(tolerance);
+
+    unsigned int steps = 0;
+    __mmask16 mask = 0;
+
+    while (mask == 0 && steps < maxSteps) {
+        for (unsigned int j = 0; j < substeps; j++) {
+            __m512 xy = _mm512_mul_ps(_mm512_mul_ps(two, x), y);
+            x = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), offsetX);
+            y = _mm512_add_ps(xy, offsetY);
+        }
+        iterCount = _mm512_add_epi32(iterCount, increment);
+        steps++;
+
+        __mmask16 cycled = _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(x, cycleRefX)), cycleTolerance, _CMP_LE_OQ)
+            & _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(y, cycleRefY)), cycleTolerance, _CMP_LE_OQ)
+            & ~restart;
+
+        __mmask16 event = _mm512_cmp_ps_mask(_mm512_abs_ps(x), four, _CMP_GT_OQ)
+            | _mm512_cmp_ps_mask(_mm512_abs_ps(y), four, _CMP_GT_OQ)
+            | _mm512_cmp_ps_mask(_mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), sixteen, _CMP_GT_OQ)
+            | _mm512_cmpge_epi32_mask(iterCount, iterLimit)
+            | cycled;
+        mask = event & lanes.active;
+
+        // Brent's bookkeeping for the lanes that carry on
+        const __mmask16 keep = ~event;
+        __m512i length = _mm512_add_epi32(cycleLength, one);
+        __mmask16 refresh = (restart | _mm512_cmpeq_epi32_mask(length, cyclePower)) & keep;
+
+        cyclePower = _mm512_mask_slli_epi32(cyclePower, refresh, cyclePower, 1);
+        cyclePower = _mm512_mask_mov_epi32(cyclePower, restart & keep, one);
+        length = _mm512_mask_mov_epi32(length, refresh, _mm512_setzero_si512());
+        cycleLength = _mm512_mask_mov_epi32(cycleLength, keep, length);
+        cycleRefX = _mm512_mask_mov_ps(cycleRefX, refresh, x);
+        cycleRefY = _mm512_mask_mov_ps(cycleRefY, refresh, y);
+        cycleOffsetX = _mm512_mask_mov_ps(cycleOffsetX, keep, offsetX);
+        cycleOffsetY = _mm512_mask_mov_ps(cycleOffsetY, keep, offsetY);
+        restart &= event;
+    }
+
+    _mm512_store_ps(lanes.posX, x);
+    _mm512_store_ps(lanes.posY, y);
+    _mm512_store_si512(lanes.iterCount, iterCount);
+
+    _mm512_store_ps(lanes.cycleOffsetX, cycleOffsetX);
+    _mm512_store_ps(lanes.cycleOffsetY, cycleOffsetY);
+    _mm512_store_ps(lanes.cycleRefX, cycleRefX);
+    _mm512_store_ps(lanes.cycleRefY, cycleRefY);
+    _mm512_store_si512(lanes.cyclePower, cyclePower);
+    _mm512_store_si512(lanes.cycleLength, cycleLength);
+
+    *events = mask;
+    return steps;
+}
+
+const SimdKernels AVX2_KERNELS = {"AVX2", 8, iterateAvx2, validAvx2};
+const SimdKernels AVX512_KERNELS = {"AVX-512", 16, iterateAvx512, validAvx512};
+
+const SimdKernels *getSimdKernels() {
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")) {
+        return &AVX512_KERNELS;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return &AVX2_KERNELS;
+    }
+
+    return NULL;
+}
+
+#else
+
+const SimdKernels *getSimdKernels() {
+    return NULL;
+}
+
+#endif
@@ -4,8 +4,14 @@
 #include <chrono>
 #include <stack>
 
+#ifdef __APPLE__
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
+#else
+#include <GL/gl.h>
+#include <GL/glu.h>
+#endif
+
 #include <GLFW/glfw3.h>
 
 #include "../imgui/imgui.h"
@@ -16,7 +22,7 @@
 
 #include "coordinates.hpp"
 #include "fractalWindow.hpp"
-#include "lodepng.hpp"
+#include "image.hpp"
 #include "opencl.hpp"
 #include "plots.hpp"
 
@@ -37,7 +43,7 @@ const size_t particleHistBins = 50;
 
 void showParticles() {
     if (!readParticles) {
-        opencl->readBuffer("particles", particles);
+        fetchParticles(particles);
         readParticles = true;
     }
 
@@ -154,6 +160,7 @@ void showInfo() {
     ImGui::Text("Frametime = %.3f", frameTime);
     ImGui::Text("Frames = %d", iterCount);
     ImGui::Text("Steps = %llu M", stepCount / 1000000LLU);
+    ImGui::Text("Steps/frame = %u", frameSteps);
 
     ScreenCoordinate screen({mouseFW.x, mouseFW.y});
     FractalCoordinate fractal = screen.toPixel(settingsFW).toFractal(viewFW);
@@ -187,8 +194,8 @@ void showControls() {
     chg |= ImGui::RadioButton("Normed Square", &(settingsFW.scoreType), ScoreOptions::SCORE_SQNORM);
 
     if (chg) {
-        opencl->step("resetCount");
-        opencl->step("initParticles");
+        resetCounts();
+        resetParticles();
         iterCount = 0;
         stepCount = 0;
     }
@@ -196,7 +203,7 @@ void showControls() {
 
 void plotParticleIterCounts() {
     if (!readParticles) {
-        opencl->readBuffer("particles", particles);
+        fetchParticles(particles);
         readParticles = true;
     }
 
@@ -230,7 +237,7 @@ void plotParticleIterCounts() {
 
 void plotParticleScores() {
     if (!readParticles) {
-        opencl->readBuffer("particles", particles);
+        fetchParticles(particles);
         readParticles = true;
     }
 
@@ -269,6 +276,51 @@ void plotParticleScores() {
     }
 }
 
+void plotTelemetry() {
+    const int count = telemetry->frameCount;
+    const int offset = telemetry->offset();
+    const int stride = sizeof(TelemetryFrame);
+
+    if (count == 0) {
+        return;
+    }
+
+    if (ImPlot::BeginPlot("Frame Time")) {
+        ImPlot::SetupAxes("frame", "ms", ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_AutoFit);
+        ImPlot::PlotLine("frame", &telemetry->frames[0].frameTime, count, 1, 0, 0, offset, stride);
+        ImPlot::EndPlot();
+    }
+
+    if (!telemetry->kernelNames.empty() && ImPlot::BeginPlot("Kernel Times")) {
+        ImPlot::SetupAxes("frame", "μs", ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_AutoFit);
+        for (size_t i = 0; i < telemetry->kernelNames.size(); i++) {
+            ImPlot::PlotLine(telemetry->kernelNames[i].c_str(), &telemetry->frames[0].kernelTimes[i], count, 1, 0, 0, offset, stride);
+        }
+        ImPlot::EndPlot();
+    }
+
+    if (ImPlot::BeginPlot("Maximum Counts")) {
+        ImPlot::SetupAxes("frame", "count", ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_AutoFit);
+        for (unsigned int i = 0; i < telemetry->threshold_count; i++) {
+            char label[32];
+            snprintf(label, sizeof(label), "%u", config->thresholds[i]);
+            ImPlot::PlotLine(label, &telemetry->frames[0].maximumCounts[i], count, 1, 0, 0, offset, stride);
+        }
+        ImPlot::EndPlot();
+    }
+
+    ImGui::Text("Samples/frame = %llu M", (unsigned long long)(telemetry->frames[(offset + count - 1) % TELEMETRY_FRAMES].samples / 1000000LLU));
+
+    if (ImGui::Button("Export")) {
+        telemetry->save(config->telemetry_file);
+    }
+}
+
+// The OpenCL backend leaves the last image in a mapped buffer instead of copying it
+uint32_t *getFramePixels() {
+    return mappedPixels ? mappedPixels : pixelsFW;
+}
+
 void displayFW() {
     // --------------------------- RESET ---------------------------
     glfwMakeContextCurrent(windowFW);
@@ -287,16 +339,19 @@ void displayFW() {
         glEnable (GL_TEXTURE_2D);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
+        // The 16-bit channels are stored big-endian for PNG
+        glPixelStorei(GL_UNPACK_SWAP_BYTES, config->output_bits == 16);
+
         glTexImage2D (
             GL_TEXTURE_2D,
             0,
-            GL_RGB,
+            config->output_bits == 32 ? GL_RGB : GL_RGBA,
             settingsFW.width,
             settingsFW.height,
             0,
-            GL_RGB,
-            GL_UNSIGNED_INT,
-            &(pixelsFW[0])
+            config->output_bits == 32 ? GL_RGB : GL_RGBA,
+            config->output_bits == 8 ? GL_UNSIGNED_BYTE : (config->output_bits == 16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT),
+            getFramePixels()
         );
 
         glPushMatrix();
@@ -362,6 +417,11 @@ void displayFW() {
         ImGui::TreePop();
     }
 
+    if (telemetry && ImGui::TreeNode("Telemetry")) {
+        plotTelemetry();
+        ImGui::TreePop();
+    }
+
     ImGui::End();
 
     // --------------------------- DRAW ---------------------------
@@ -392,12 +452,9 @@ void updateView(float scale, float centerX, float centerY, float theta) {
     viewFW.cosTheta = cos(theta);
     viewFW.sinTheta = sin(theta);
 
-    for (string name : getMandelNames()) {
-        opencl->setKernelArg(name, 7, sizeof(ViewSettings), (void*)&viewFW);
-    }
-
-    opencl->step("resetCount");
-    opencl->step("initParticles");
+    applyView();
+    resetCounts();
+    resetParticles();
 
     prevMax = 0;
     stepCount = 0;
@@ -421,32 +478,8 @@ void selectRegion() {
     );
 }
 
-void writePng() {
-    char filename[200];
-
-    uint32_t h = settingsFW.height; 
-    uint32_t w = settingsFW.width; 
-
-    const auto p1 = std::chrono::system_clock::now();
-    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(p1.time_since_epoch()).count();
-
-    sprintf(filename, "images/%lld_%s_%d_%d_%.6f_%.6f_%.6f_%.6f.png", 
-        seconds, getMandelName().c_str(), settingsFW.width, settingsFW.height,
-        viewFW.theta, viewFW.centerX, viewFW.centerY, viewFW.scaleY);
-    
-    unsigned char *image8Bit = (unsigned char *)malloc(3 * w * h * sizeof(unsigned char));
-
-    for (uint32_t i = 0; i < h; i++) {
-        for (uint32_t j = 0; j < 3 * w; j++) {
-            image8Bit[3 * w * (h - i - 1) + j] = pixelsFW[3 * w * i + j] >> ((sizeof(unsigned int) - sizeof(unsigned char)) * 8);
-        }
-    }
-    
-    unsigned error = lodepng_encode24_file(filename, image8Bit, settingsFW.width, settingsFW.height);
-
-    if (error){
-        fprintf(stderr, "Encoder error %d: %s\n", error, lodepng_error_text(error));
-    }
+void savePng() {
+    writePng(getPngFilename(getMandelName(), viewFW).c_str(), getFramePixels(), settingsFW.width, settingsFW.height, config->output_bits);
 }
 
 void keyPressedFW(GLFWwindow* window, unsigned int key) {
@@ -482,12 +515,9 @@ void keyPressedFW(GLFWwindow* window, unsigned int key) {
                 viewFW = viewStackFW.top();
                 viewStackFW.pop();
 
-                for (string name : getMandelNames()) {
-                    opencl->setKernelArg(name, 7, sizeof(ViewSettings), (void*)&viewFW);
-                }
-
-                opencl->step("resetCount");
-                opencl->step("initParticles");
+                applyView();
+                resetCounts();
+                resetParticles();
                 iterCount = 0;
                 stepCount = 0;
             }
@@ -507,14 +537,14 @@ void keyPressedFW(GLFWwindow* window, unsigned int key) {
             exit(0);
             break;
         case 'R':
-            opencl->step("resetCount");
+            resetCounts();
             iterCount = 0;
             stepCount = 0;
         case 'i':
-            opencl->step("initParticles");
+            resetParticles();
             break;
         case 'W':
-            writePng();
+            savePng();
             break;
         
         case '-':
@@ -634,13 +664,9 @@ void createFractalWindow(char *name, uint32_t width, uint32_t height) {
     settingsFW.width = width;
     settingsFW.height = height;
 
-    pixelsFW = (uint32_t *)malloc(3 * width * height * sizeof(uint32_t));
+    pixelsFW = (uint32_t *)calloc(getImageSize(config->output_bits, width * height), 1);
     particles = (Particle *)malloc(config->particle_count * sizeof(Particle));
 
-    for (int i = 0; i < 3 * width * height; i++) {
-        pixelsFW[i] = 0;
-    }
-
     windowFW = glfwCreateWindow(width, height, name, NULL, NULL);
     if (windowFW == nullptr) {
         glfwTerminate();
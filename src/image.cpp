@@ -0,0 +1,77 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "image.hpp"
+#include "lodepng.hpp"
+
+using namespace std;
+
+string getPngFilename(string mandelName, ViewSettings view) {
+    char filename[200];
+
+    const auto p1 = std::chrono::system_clock::now();
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(p1.time_since_epoch()).count();
+
+    sprintf(filename, "images/%lld_%s_%d_%d_%.6f_%.6f_%.6f_%.6f.png", 
+        (long long)seconds, mandelName.c_str(), view.sizeX, view.sizeY,
+        view.theta, view.centerX, view.centerY, view.scaleY);
+
+    return filename;
+}
+
+/**
+ * Converts the 32-bit RGB output of renderImage to 8-bit and copies it to
+ * (x0, y0) in a larger image, flipping it on the way since the rows are
+ * stored bottom to top for OpenGL.
+ */
+void copyRgb8(uint32_t *pixels, uint32_t width, uint32_t height, unsigned char *target, uint32_t targetWidth, uint32_t targetHeight, uint32_t x0, uint32_t y0) {
+    for (uint32_t i = 0; i < height; i++) {
+        unsigned char *row = target + 3 * ((size_t)targetWidth * (targetHeight - y0 - i - 1) + x0);
+
+        for (uint32_t j = 0; j < 3 * width; j++) {
+            row[j] = pixels[3 * width * i + j] >> ((sizeof(unsigned int) - sizeof(unsigned char)) * 8);
+        }
+    }
+}
+
+void reportPngError(const char *filename, unsigned error) {
+    if (error){
+        fprintf(stderr, "Encoder error %d: %s\n", error, lodepng_error_text(error));
+    } else {
+        fprintf(stderr, "Saved %s\n", filename);
+    }
+}
+
+void writePngRgb8(const char *filename, unsigned char *pixels, uint32_t width, uint32_t height) {
+    reportPngError(filename, lodepng_encode24_file(filename, pixels, width, height));
+}
+
+/**
+ * The 8 and 16-bit outputs already are PNG's RGBA layout, so only the rows
+ * are flipped. The 32-bit output is converted to 8-bit RGB first.
+ */
+void writePng(const char *filename, void *pixels, uint32_t width, uint32_t height, unsigned int outputBits) {
+    if (outputBits == 32) {
+        unsigned char *image8Bit = (unsigned char *)malloc(3 * width * height * sizeof(unsigned char));
+
+        copyRgb8((uint32_t *)pixels, width, height, image8Bit, width, height, 0, 0);
+        writePngRgb8(filename, image8Bit, width, height);
+
+        free(image8Bit);
+        return;
+    }
+
+    const size_t rowSize = getImageSize(outputBits, width);
+    unsigned char *flipped = (unsigned char *)malloc(rowSize * height);
+
+    for (uint32_t i = 0; i < height; i++) {
+        memcpy(flipped + rowSize * (height - i - 1), (unsigned char *)pixels + rowSize * i, rowSize);
+    }
+
+    reportPngError(filename, lodepng_encode_file(filename, flipped, width, height, LCT_RGBA, outputBits));
+
+    free(flipped);
+}
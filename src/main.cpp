@@ -1,15 +1,25 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <math.h>
+#include <thread>
 
 #include <GLFW/glfw3.h>
 
+#include "bench.hpp"
+#include "checkpoint.hpp"
 #include "config.hpp"
+#include "cpuEngine.hpp"
 #include "fractalWindow.hpp"
+#include "image.hpp"
 #include "opencl.hpp"
 #include "pcg.hpp"
+#include "sampleGrid.hpp"
+#include "telemetry.hpp"
 
 using namespace std;
 
@@ -18,7 +28,19 @@ using namespace std;
  */
 
 Config *config;
-unsigned int maximaKernelSize;
+
+// Must match REDUCE_SIZE in buddha.cl, REDUCE_GROUPS is the number of partial maxima per threshold
+const unsigned int REDUCE_SIZE = 128;
+const unsigned int REDUCE_GROUPS = 64;
+
+// Must match QUEUE_SIZE in buddha.cl
+const unsigned int QUEUE_SIZE = 4;
+const unsigned int PERSISTENT_GROUP_SIZE = 128;
+
+// Iterations, samples and iterations saved by cycle detection as low and high words, see BENCH_STATS in buddha.cl
+const unsigned int STATS_SIZE = 6;
+unsigned int pixelCount;
+unsigned int reduceGroups = REDUCE_GROUPS;
 
 chrono::high_resolution_clock::time_point timePoint;
 unsigned int frameCount = 0;
@@ -26,6 +48,13 @@ float frameTime = 0;
 uint32_t iterCount = 0;
 uint64_t stepCount = 0;
 
+// mandelStep launches per frame, starts at frame_steps and follows the frame time target if one is set
+unsigned int frameSteps;
+
+// NULL unless telemetry is enabled in the config
+Telemetry *telemetry = NULL;
+vector<KernelTime> noKernelTimes;
+
 typedef struct FractalCoord {
     cl_float2 pos;
 } FractalCoord;
@@ -34,30 +63,72 @@ typedef struct FractalCoord {
  * OpenCL
  */
 
-OpenCl *opencl;
+OpenCl *opencl = NULL;
+CpuEngine *cpuEngine = NULL;
 uint64_t *initState, *initSeq;
+
+// Key and launch counter of the counter RNG, stepRandom bumps the counter for every launch
+cl_ulong rngSeed, rngLaunch = 0;
+map<string, cl_uint> rngLaunchArgs;
 uint32_t *maximumCounts;
 
+// Cells getNewPos draws from, empty when sample_grid = 0
+vector<uint32_t> sampleCells;
+
+// Table, densities and scores from createImportanceMap, empty unless importance_map is on
+vector<uint32_t> importanceMap;
+// mandelStep launches since the importance map was last rebuilt
+unsigned int importanceSteps = 0;
+
+// What the sampleCells buffer holds
+vector<uint32_t> &getSampleBuffer() {
+    return importanceMap.empty() ? sampleCells : importanceMap;
+}
+
 uint32_t prevMax = 0;
 
+// The window alternates renderImage between these, see enqueueOpenCl
+const char *imageBuffers[2] = {"image", "imageBack"};
+unsigned int imageIndex = 0;
+uint32_t *mappedPixels = NULL;
+uint32_t *pendingPixels = NULL;
+unsigned int mappedIndex;
+uint32_t *pendingMaximum;
+cl_event imageEvent, maximumEvent;
+
 vector<BufferSpec> bufferSpecs;
 void createBufferSpecs() {
+    // Replayed orbits never touch the path buffer, but the kernels still need a valid argument
+    size_t pathSize = config->replay_path ? 1 : config->particle_count * config->thresholds[config->threshold_count - 1];
+    size_t snapshotSize = config->deterministic ? config->threshold_count * config->width * config->height : 1;
+    // The counter RNG keeps no state, the kernels still need valid arguments for the PCG buffers
+    size_t rngSize = config->counter_rng ? 1 : config->particle_count;
+    size_t sampleCellsSize = getSampleBuffer().empty() ? 1 : getSampleBuffer().size();
+
     bufferSpecs = {
-        {"image",     {NULL, 3 * config->width * config->height * sizeof(uint32_t)}},
+        {"image",     {NULL, getImageSize(config->output_bits, config->width * config->height), CL_MEM_ALLOC_HOST_PTR}},
+        {"imageBack", {NULL, getImageSize(config->output_bits, config->width * config->height), CL_MEM_ALLOC_HOST_PTR}},
         {"count",     {NULL, config->threshold_count * config->width * config->height * sizeof(uint32_t)}},
         {"prevCount", {NULL, config->threshold_count * config->width * config->height * sizeof(uint32_t)}},
         {"countDiff", {NULL, config->threshold_count * config->width * config->height * sizeof(uint32_t)}},
+        {"snapshot",  {NULL, snapshotSize * sizeof(uint32_t)}},
         {"particles", {NULL, config->particle_count * sizeof(Particle)}},
-        {"path",      {NULL, config->particle_count * config->thresholds[config->threshold_count - 1] * sizeof(FractalCoord)}},
+        {"queue",     {NULL, QUEUE_SIZE * sizeof(uint32_t)}},
+        {"splatList", {NULL, config->particle_count * sizeof(uint32_t)}},
+        {"stats",     {NULL, STATS_SIZE * sizeof(uint32_t)}},
+        {"path",      {NULL, pathSize * sizeof(FractalCoord)}},
         {"threshold", {NULL, config->threshold_count * sizeof(uint32_t)}},
+        {"sampleCells", {NULL, sampleCellsSize * sizeof(uint32_t)}},
+        {"pool",      {NULL, POOL_SIZE * sizeof(PoolEntry)}},
 
-        {"maxima", {NULL, config->threshold_count * maximaKernelSize * sizeof(uint32_t)}},
+        {"maxima",     {NULL, config->threshold_count * REDUCE_GROUPS * sizeof(uint32_t)}},
+        {"maximaDiff", {NULL, config->threshold_count * REDUCE_GROUPS * sizeof(uint32_t)}},
         {"maximum", {NULL, config->threshold_count * sizeof(uint32_t)}},
 
-        {"randomState",     {NULL, config->particle_count * sizeof(uint64_t)}},
-        {"randomIncrement", {NULL, config->particle_count * sizeof(uint64_t)}},
-        {"initState",       {NULL, config->particle_count * sizeof(uint64_t)}},
-        {"initSeq",         {NULL, config->particle_count * sizeof(uint64_t)}},
+        {"randomState",     {NULL, rngSize * sizeof(uint64_t)}},
+        {"randomIncrement", {NULL, rngSize * sizeof(uint64_t)}},
+        {"initState",       {NULL, rngSize * sizeof(uint64_t)}},
+        {"initSeq",         {NULL, rngSize * sizeof(uint64_t)}},
     };
 }
 
@@ -138,60 +209,93 @@ string getMandelName() {
 vector<KernelSpec> kernelSpecs;
 void createKernelSpecs() {
     kernelSpecs = {
-        {"seedNoise",      {NULL, 1, {config->particle_count, 0}, {128, 0}, "seedNoise"}},
         {"initParticles",  {NULL, 1, {config->particle_count, 0}, {128, 0}, "initParticles"}},
-        {"resetCount",     {NULL, 1, {config->threshold_count * maximaKernelSize, 0}, {0, 0}, "resetCount"}},
-        {"findMax1",       {NULL, 1, {config->threshold_count * maximaKernelSize, 0}, {0, 0}, "findMax1"}},
-        {"findMax2",       {NULL, 1, {config->threshold_count, 0}, {config->threshold_count, 0}, "findMax2"}},
-        {"findMaxDiff",    {NULL, 1, {config->threshold_count * maximaKernelSize, 0}, {0, 0}, "findMax1"}},
+        {"rewindParticles", {NULL, 1, {config->particle_count, 0}, {128, 0}, "rewindParticles"}},
+        {"resetCount",     {NULL, 1, {config->threshold_count * pixelCount, 0}, {0, 0}, "resetCount"}},
+        {"findMax1",       {NULL, 2, {REDUCE_GROUPS * REDUCE_SIZE, config->threshold_count}, {REDUCE_SIZE, 1}, "findMax1"}},
+        {"findMax2",       {NULL, 2, {REDUCE_SIZE, config->threshold_count}, {REDUCE_SIZE, 1}, "findMax2"}},
+        {"findMax2Diff",   {NULL, 2, {REDUCE_SIZE, config->threshold_count}, {REDUCE_SIZE, 1}, "findMax2"}},
         {"renderImage",    {NULL, 2, {config->width, config->height}, {0, 0}, "renderImage"}},
         {"renderImageD",   {NULL, 2, {config->width, config->height}, {0, 0}, "renderImage"}},
-        {"updateDiff",     {NULL, 2, {config->width, config->height}, {0, 0}, "updateDiff"}},
+        {"updateDiff",     {NULL, 2, {REDUCE_GROUPS * REDUCE_SIZE, config->threshold_count}, {REDUCE_SIZE, 1}, "updateDiff"}},
+        {"resetQueue",     {NULL, 1, {QUEUE_SIZE, 0}, {0, 0}, "resetQueue"}},
+        {"updatePool",     {NULL, 1, {POOL_SIZE, 0}, {128, 0}, "updatePool"}},
     };
 
-    for (string name : getMandelNames()) {
-        kernelSpecs.push_back({name, {NULL, 1, {config->particle_count, 0}, {128, 0}, name}});
+    // Only the PCG build has it
+    if (!config->counter_rng) {
+        kernelSpecs.push_back({"seedNoise", {NULL, 1, {config->particle_count, 0}, {128, 0}, "seedNoise"}});
     }
 }
 
-void setKernelArgs() {
-    opencl->setKernelBufferArg("seedNoise", 0, "randomState");
-    opencl->setKernelBufferArg("seedNoise", 1, "randomIncrement");
-    opencl->setKernelBufferArg("seedNoise", 2, "initState");
-    opencl->setKernelBufferArg("seedNoise", 3, "initSeq");
+/**
+ * The RNG arguments at index and index + 1 are the PCG state buffers, or
+ * the seed and launch counter of the counter RNG.
+ */
+void setRngArgs(string name, cl_uint index) {
+    if (config->counter_rng) {
+        opencl->setKernelArg(name, index, sizeof(cl_ulong), (void*)&rngSeed);
+        opencl->setKernelArg(name, index + 1, sizeof(cl_ulong), (void*)&rngLaunch);
+        rngLaunchArgs[name] = index + 1;
+    } else {
+        opencl->setKernelBufferArg(name, index, "randomState");
+        opencl->setKernelBufferArg(name, index + 1, "randomIncrement");
+    }
+}
 
-    for (string name : getMandelNames()) {
-        opencl->setKernelBufferArg(name, 0, "particles");
-        opencl->setKernelBufferArg(name, 1, "count");
-        opencl->setKernelBufferArg(name, 2, "threshold");
-        opencl->setKernelBufferArg(name, 3, "path");
-        opencl->setKernelBufferArg(name, 4, "randomState");
-        opencl->setKernelBufferArg(name, 5, "randomIncrement");
-        opencl->setKernelArg(name, 6, sizeof(unsigned int), (void*)&(config->threshold_count));
-        opencl->setKernelArg(name, 7, sizeof(ViewSettings), (void*)&viewFW);
+// Every launch of a kernel that draws random numbers needs its own counter
+void stepRandom(string name, int count = 1) {
+    if (!config->counter_rng) {
+        opencl->step(name, count);
+        return;
     }
-    
+
+    for (int i = 0; i < count; i++) {
+        opencl->setKernelArg(name, rngLaunchArgs[name], sizeof(cl_ulong), (void*)&rngLaunch);
+        opencl->step(name);
+        rngLaunch++;
+    }
+}
+
+void setKernelArgs() {
+    if (!config->counter_rng) {
+        opencl->setKernelBufferArg("seedNoise", 0, "randomState");
+        opencl->setKernelBufferArg("seedNoise", 1, "randomIncrement");
+        opencl->setKernelBufferArg("seedNoise", 2, "initState");
+        opencl->setKernelBufferArg("seedNoise", 3, "initSeq");
+    }
+
     opencl->setKernelBufferArg("initParticles", 0, "particles");
     opencl->setKernelBufferArg("initParticles", 1, "threshold");
     opencl->setKernelBufferArg("initParticles", 2, "path");
-    opencl->setKernelBufferArg("initParticles", 3, "randomState");
-    opencl->setKernelBufferArg("initParticles", 4, "randomIncrement");
+    setRngArgs("initParticles", 3);
     opencl->setKernelArg("initParticles", 5, sizeof(unsigned int), (void*)&(config->threshold_count));
+    opencl->setKernelBufferArg("initParticles", 6, "sampleCells");
+
+    opencl->setKernelBufferArg("rewindParticles", 0, "particles");
+    opencl->setKernelBufferArg("rewindParticles", 1, "threshold");
+    opencl->setKernelBufferArg("rewindParticles", 2, "path");
+    opencl->setKernelArg("rewindParticles", 3, sizeof(unsigned int), (void*)&(config->threshold_count));
     
     opencl->setKernelBufferArg("resetCount", 0, "count");
-    opencl->setKernelArg("resetCount", 1, sizeof(unsigned int), (void*)&(config->maximum_size));
+
+    opencl->setKernelBufferArg("resetQueue", 0, "queue");
+
+    opencl->setKernelBufferArg("updatePool", 0, "particles");
+    opencl->setKernelBufferArg("updatePool", 1, "pool");
+    opencl->setKernelArg("updatePool", 2, sizeof(unsigned int), (void*)&(config->particle_count));
 
     opencl->setKernelBufferArg("findMax1", 0, "count");
     opencl->setKernelBufferArg("findMax1", 1, "maxima");
-    opencl->setKernelArg("findMax1", 2, sizeof(unsigned int), (void*)&(config->maximum_size));
+    opencl->setKernelArg("findMax1", 2, sizeof(unsigned int), (void*)&pixelCount);
     
     opencl->setKernelBufferArg("findMax2", 0, "maxima");
     opencl->setKernelBufferArg("findMax2", 1, "maximum");
-    opencl->setKernelArg("findMax2", 2, sizeof(unsigned int), (void*)&maximaKernelSize);
+    opencl->setKernelArg("findMax2", 2, sizeof(unsigned int), (void*)&reduceGroups);
 
-    opencl->setKernelBufferArg("findMaxDiff", 0, "countDiff");
-    opencl->setKernelBufferArg("findMaxDiff", 1, "maxima");
-    opencl->setKernelArg("findMaxDiff", 2, sizeof(unsigned int), (void*)&(config->maximum_size));
+    opencl->setKernelBufferArg("findMax2Diff", 0, "maximaDiff");
+    opencl->setKernelBufferArg("findMax2Diff", 1, "maximum");
+    opencl->setKernelArg("findMax2Diff", 2, sizeof(unsigned int), (void*)&reduceGroups);
     
     opencl->setKernelBufferArg("renderImage", 0, "count");
     opencl->setKernelBufferArg("renderImage", 1, "maximum");
@@ -206,11 +310,105 @@ void setKernelArgs() {
     opencl->setKernelBufferArg("updateDiff", 0, "count");
     opencl->setKernelBufferArg("updateDiff", 1, "prevCount");
     opencl->setKernelBufferArg("updateDiff", 2, "countDiff");
-    opencl->setKernelArg("updateDiff", 3, sizeof(float), (void*)&(config->alpha));
-    opencl->setKernelArg("updateDiff", 4, sizeof(unsigned int), (void*)&(config->threshold_count));
+    opencl->setKernelBufferArg("updateDiff", 3, "maxima");
+    opencl->setKernelBufferArg("updateDiff", 4, "maximaDiff");
+    opencl->setKernelArg("updateDiff", 5, sizeof(float), (void*)&(config->alpha));
+    opencl->setKernelArg("updateDiff", 6, sizeof(unsigned int), (void*)&pixelCount);
+}
+
+size_t getPersistentSize() {
+    unsigned int groups = config->persistent_groups > 0 ? config->persistent_groups : 4 * opencl->compute_units;
+    return groups * PERSISTENT_GROUP_SIZE;
+}
+
+// Only the bench build has the stats argument
+void setStatsArg(string name, cl_uint index) {
+    if (config->bench) {
+        opencl->setKernelBufferArg(name, index, "stats");
+    }
+}
+
+// Created after the context exists, since the launch size depends on the device
+void createEscapeKernel() {
+    opencl->createKernel({"mandelEscape", {NULL, 1, {getPersistentSize(), 0}, {PERSISTENT_GROUP_SIZE, 0}, "mandelEscape"}}, "");
+
+    opencl->setKernelBufferArg("mandelEscape", 0, "particles");
+    opencl->setKernelBufferArg("mandelEscape", 1, "threshold");
+    opencl->setKernelBufferArg("mandelEscape", 2, "path");
+    setRngArgs("mandelEscape", 3);
+    opencl->setKernelBufferArg("mandelEscape", 5, "queue");
+    opencl->setKernelBufferArg("mandelEscape", 6, "splatList");
+    opencl->setKernelArg("mandelEscape", 7, sizeof(unsigned int), (void*)&(config->threshold_count));
+    opencl->setKernelArg("mandelEscape", 8, sizeof(ViewSettings), (void*)&viewFW);
+    opencl->setKernelArg("mandelEscape", 9, sizeof(unsigned int), (void*)&(config->particle_count));
+    opencl->setKernelBufferArg("mandelEscape", 10, "sampleCells");
+    setStatsArg("mandelEscape", 11);
+}
+
+void setMandelArgs(string name) {
+    opencl->setKernelBufferArg(name, 0, "particles");
+    opencl->setKernelBufferArg(name, 1, "count");
+    opencl->setKernelBufferArg(name, 2, "threshold");
+    opencl->setKernelBufferArg(name, 3, "path");
+    setRngArgs(name, 4);
+    opencl->setKernelArg(name, 6, sizeof(unsigned int), (void*)&(config->threshold_count));
+    opencl->setKernelArg(name, 7, sizeof(ViewSettings), (void*)&viewFW);
+    opencl->setKernelBufferArg(name, 8, "snapshot");
+    opencl->setKernelBufferArg(name, 9, "sampleCells");
+    opencl->setKernelBufferArg(name, 10, "pool");
+
+    cl_uint crossPollinate = settingsFW.crossPollinate;
+    opencl->setKernelArg(name, 11, sizeof(cl_uint), (void*)&crossPollinate);
+}
+
+/**
+ * The mandelStep kernels are only built once the path and score combination
+ * is first used, each in its own program so the compiler sees the options as
+ * constants. OpenCl keeps the programs and kernels around for switching back.
+ */
+string getMandelKernel() {
+    string name = "mandelStep_" + getMandelName();
+
+    if (!opencl->hasKernel(name)) {
+        char options[100];
+        sprintf(options, "-DPATH_TYPE=%d -DSCORE_TYPE=%d", settingsFW.pathType, settingsFW.scoreType);
+
+        opencl->createKernel({name, {NULL, 1, {config->particle_count, 0}, {128, 0}, name}}, options);
+        setMandelArgs(name);
+        setStatsArg(name, 12);
+    }
+
+    return name;
 }
 
+// The splat phase of the persistent variant, comes from the same program as getMandelKernel
+string getSplatKernel() {
+    string name = "mandelSplat_" + getMandelName();
+
+    if (!opencl->hasKernel(name)) {
+        char options[100];
+        sprintf(options, "-DPATH_TYPE=%d -DSCORE_TYPE=%d", settingsFW.pathType, settingsFW.scoreType);
+
+        opencl->createKernel({name, {NULL, 1, {getPersistentSize(), 0}, {PERSISTENT_GROUP_SIZE, 0}, name}}, options);
+        setMandelArgs(name);
+        opencl->setKernelBufferArg(name, 12, "queue");
+        opencl->setKernelBufferArg(name, 13, "splatList");
+        setStatsArg(name, 14);
+    }
+
+    return name;
+}
+
+// The counter RNG only needs a key, the PCG streams are seeded on the device from host generated seeds
 void initPcg() {
+    if (config->counter_rng) {
+        rngSeed = ((cl_ulong)pcg32_random() << 32) | pcg32_random();
+        return;
+    }
+
+    initState = (uint64_t *)malloc(config->particle_count * sizeof(uint64_t));
+    initSeq = (uint64_t *)malloc(config->particle_count * sizeof(uint64_t));
+
     for (int i = 0; i < config->particle_count; i++) {
         initState[i] = pcg32_random();
         initSeq[i] = pcg32_random();
@@ -225,6 +423,80 @@ void initPcg() {
     free(initSeq);
 }
 
+string getBuildOptions() {
+    string options;
+
+    if (config->replay_path) {
+        options += "-DREPLAY_PATH ";
+    }
+
+    if (config->local_histogram) {
+        options += "-DLOCAL_HISTOGRAM ";
+    }
+
+    if (config->deterministic) {
+        options += "-DDETERMINISTIC ";
+    }
+
+    if (config->bench) {
+        options += "-DBENCH_STATS ";
+    }
+
+    if (config->counter_rng) {
+        options += "-DCOUNTER_RNG ";
+    }
+
+    if (!sampleCells.empty()) {
+        options += "-DSAMPLE_GRID=" + to_string(config->sample_grid) + " ";
+    }
+
+    if (!importanceMap.empty()) {
+        options += "-DIMPORTANCE_MAP=" + to_string(importanceMap[0]) + " ";
+    }
+
+    if (config->cycle_detection) {
+        // to_string rounds to 6 decimals, the exponent form keeps small tolerances intact
+        char tolerance[32];
+        snprintf(tolerance, sizeof(tolerance), "%.9ef", config->cycle_tolerance);
+        options += "-DCYCLE_TOLERANCE=" + string(tolerance) + " ";
+    }
+
+    // Fixed for the whole run, so they can be baked into the kernels
+    options += "-DTHRESHOLD_COUNT=" + to_string(config->threshold_count) + " -DTHRESHOLDS=";
+    for (unsigned int i = 0; i < config->threshold_count; i++) {
+        options += (i > 0 ? "," : "") + to_string(config->thresholds[i]);
+    }
+
+    options += " -DIMAGE_WIDTH=" + to_string(config->width) + " -DIMAGE_HEIGHT=" + to_string(config->height);
+    options += " -DOUTPUT_BITS=" + to_string(config->output_bits);
+    options += " -DSUBSTEPS=" + to_string(config->unroll) + " -DSTEP_ITERATIONS=" + to_string(4000 / config->unroll) + " ";
+
+    return options;
+}
+
+/**
+ * The kernels only compare iterCount with the thresholds after every
+ * SUBSTEPS iterations. iterCount starts at 1, so a threshold can only be
+ * matched exactly when threshold - 1 is a multiple of the unroll factor.
+ * It also has to divide the 4000 iterations of a launch. Returns the
+ * largest factor up to unroll that does both.
+ */
+unsigned int getValidUnroll(unsigned int unroll) {
+    for (unsigned int factor = max(1u, unroll); factor > 1; factor--) {
+        bool aligned = 4000 % factor == 0;
+
+        for (unsigned int i = 0; i < config->threshold_count && aligned; i++) {
+            aligned = (config->thresholds[i] - 1) % factor == 0;
+        }
+
+        if (aligned) {
+            return factor;
+        }
+    }
+
+    return 1;
+}
+
 void prepareOpenCl() {
     createBufferSpecs();
     createKernelSpecs();
@@ -234,24 +506,476 @@ void prepareOpenCl() {
         bufferSpecs,
         kernelSpecs,
         config->profile,
-        true,
-        config->verbose
+        config->use_gpu,
+        config->verbose,
+        getBuildOptions(),
+        config->program_cache ? "cache" : ""
     );
 
     setKernelArgs();
+    createEscapeKernel();
     
     initPcg();
     opencl->writeBuffer("threshold", &(config->thresholds));
-    opencl->step("initParticles");
+    if (!getSampleBuffer().empty()) {
+        opencl->writeBuffer("sampleCells", getSampleBuffer().data());
+    }
+    stepRandom("initParticles");
+    opencl->step("updatePool");
 }
 
-void prepare() {
-    pcg32_srandom(time(NULL) ^ (intptr_t)&printf, (intptr_t)&(config->particle_count));
+void prepareCpuEngine() {
+    cpuEngine = new CpuEngine(config, config->thread_count);
+    cpuEngine->setSampleCells(getSampleBuffer());
 
-    initState = (uint64_t *)malloc(config->particle_count * sizeof(uint64_t));
-    initSeq = (uint64_t *)malloc(config->particle_count * sizeof(uint64_t));
+    cpuEngine->seed();
+    cpuEngine->setView(viewFW);
+    cpuEngine->initParticles();
+    cpuEngine->updatePool();
+}
+
+/**
+ * Backend dispatch, so the window doesn't need to know which engine is running
+ */
+
+void resetCounts() {
+    if (cpuEngine) {
+        cpuEngine->resetCount();
+    } else {
+        opencl->step("resetCount");
+    }
+}
+
+void uploadImportance() {
+    if (cpuEngine) {
+        cpuEngine->setSampleCells(importanceMap);
+    } else {
+        opencl->writeBuffer("sampleCells", importanceMap.data());
+    }
+}
+
+// What was learned for one view says little about the next
+void resetImportance() {
+    if (importanceMap.empty()) {
+        return;
+    }
+
+    importanceMap = createImportanceMap(sampleCells, config->sample_grid);
+    importanceSteps = 0;
+    uploadImportance();
+}
+
+// Rebuilds the importance map from the scores added since the last rebuild, every importance_interval launches
+void updateImportance(unsigned int steps) {
+    if (importanceMap.empty() || config->importance_interval == 0) {
+        return;
+    }
+
+    importanceSteps += steps;
+
+    if (importanceSteps < config->importance_interval) {
+        return;
+    }
+
+    importanceSteps = 0;
+
+    if (cpuEngine) {
+        importanceMap = cpuEngine->sampleCells;
+    } else {
+        opencl->readBuffer("sampleCells", importanceMap.data());
+    }
+
+    updateImportanceMap(importanceMap, sampleCells, config->sample_grid);
+    uploadImportance();
+}
+
+// Refreshed once per stepMandel call, so the entries lag behind by at most a frame
+void updatePool() {
+    if (cpuEngine) {
+        cpuEngine->updatePool();
+    } else {
+        opencl->step("updatePool");
+    }
+}
+
+void resetParticles() {
+    resetImportance();
+
+    if (cpuEngine) {
+        cpuEngine->initParticles();
+    } else {
+        stepRandom("initParticles");
+    }
+
+    // Entries from the previous view would pull the particles back there
+    updatePool();
+}
+
+// The window toggles it at any time, so it is passed to the kernels on every stepMandel
+void applyCrossPollinate() {
+    if (cpuEngine) {
+        cpuEngine->crossPollinate = settingsFW.crossPollinate;
+        return;
+    }
+
+    cl_uint crossPollinate = settingsFW.crossPollinate;
+
+    for (string name : getMandelNames()) {
+        string splatName = "mandelSplat" + name.substr(name.find('_'));
+
+        if (opencl->hasKernel(name)) {
+            opencl->setKernelArg(name, 11, sizeof(cl_uint), (void*)&crossPollinate);
+        }
+
+        if (opencl->hasKernel(splatName)) {
+            opencl->setKernelArg(splatName, 11, sizeof(cl_uint), (void*)&crossPollinate);
+        }
+    }
+}
+
+void applyView() {
+    if (cpuEngine) {
+        cpuEngine->setView(viewFW);
+        return;
+    }
+
+    for (string name : getMandelNames()) {
+        string splatName = "mandelSplat" + name.substr(name.find('_'));
+
+        if (opencl->hasKernel(name)) {
+            opencl->setKernelArg(name, 7, sizeof(ViewSettings), (void*)&viewFW);
+        }
+
+        if (opencl->hasKernel(splatName)) {
+            opencl->setKernelArg(splatName, 7, sizeof(ViewSettings), (void*)&viewFW);
+        }
+    }
+
+    opencl->setKernelArg("mandelEscape", 8, sizeof(ViewSettings), (void*)&viewFW);
+}
+
+void fetchParticles(Particle *particles) {
+    if (cpuEngine) {
+        cpuEngine->readParticles(particles);
+    } else {
+        opencl->readBuffer("particles", particles);
+    }
+}
+
+void fetchCounts(uint32_t *counts) {
+    if (cpuEngine) {
+        copy(cpuEngine->count.begin(), cpuEngine->count.end(), counts);
+    } else {
+        opencl->readBuffer("count", counts);
+    }
+}
+
+void stepMandel(int count) {
+    applyCrossPollinate();
+
+    if (cpuEngine) {
+        cpuEngine->step(settingsFW.pathType, settingsFW.scoreType, count);
+        updateImportance(count);
+
+        if (settingsFW.crossPollinate) {
+            updatePool();
+        }
+        return;
+    }
+
+    if (config->persistent_threads) {
+        string splatName = getSplatKernel();
+
+        for (int i = 0; i < count; i++) {
+            if (config->deterministic) {
+                opencl->copyBuffer("count", "snapshot");
+            }
+
+            opencl->step("resetQueue");
+            stepRandom("mandelEscape");
+            stepRandom(splatName);
+        }
+    } else if (config->deterministic) {
+        string kernelName = getMandelKernel();
+
+        for (int i = 0; i < count; i++) {
+            opencl->copyBuffer("count", "snapshot");
+            stepRandom(kernelName);
+        }
+    } else {
+        stepRandom(getMandelKernel(), count);
+    }
+
+    updateImportance(count);
+
+    if (settingsFW.crossPollinate) {
+        updatePool();
+    }
+}
+
+// Blocks until everything enqueued so far has run
+void resetStats() {
+    if (cpuEngine) {
+        cpuEngine->resetStats();
+    } else {
+        uint32_t zero[STATS_SIZE] = {0};
+        opencl->writeBuffer("stats", zero);
+    }
+}
+
+// Orbit iterations, splatted orbits and iterations skipped by cycle resets
+// since resetStats, the kernels only count them in bench builds
+void fetchStats(uint64_t *iterations, uint64_t *samples, uint64_t *saved) {
+    if (cpuEngine) {
+        *iterations = cpuEngine->iterationCount;
+        *samples = cpuEngine->sampleCount;
+        *saved = cpuEngine->savedCount;
+        return;
+    }
+
+    uint32_t stats[STATS_SIZE];
+    opencl->readBuffer("stats", stats);
+
+    *iterations = ((uint64_t)stats[1] << 32) | stats[0];
+    *samples = ((uint64_t)stats[3] << 32) | stats[2];
+    *saved = ((uint64_t)stats[5] << 32) | stats[4];
+}
+
+void finishSteps() {
+    if (opencl) {
+        opencl->finish();
+        opencl->endFrame();
+    }
+}
+
+void releaseBackend() {
+    if (opencl) {
+        opencl->cleanup();
+        delete opencl;
+        opencl = NULL;
+    }
+
+    if (cpuEngine) {
+        delete cpuEngine;
+        cpuEngine = NULL;
+    }
+
+    free(maximumCounts);
+    free(pendingMaximum);
+}
+
+/**
+ * Checkpoints. The buffers are read without blocking and written to disk on a
+ * separate thread, so display() never waits on the file system.
+ */
+
+Checkpoint checkpoint;
+thread checkpointThread;
+atomic<bool> checkpointBusy(false);
+chrono::high_resolution_clock::time_point lastCheckpoint;
+
+bool setMandelName(string name) {
+    for (size_t i = 0; i < pathExtenstions.size(); i++) {
+        for (size_t j = 0; j < scoreExtenstions.size(); j++) {
+            if (pathExtenstions[i] + "_" + scoreExtenstions[j] == name) {
+                settingsFW.pathType = i;
+                settingsFW.scoreType = j;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void fillHeader(CheckpointHeader &header) {
+    header.view = viewFW;
+    header.width = config->width;
+    header.height = config->height;
+    header.thresholdCount = config->threshold_count;
+    copy(config->thresholds, config->thresholds + 5, header.thresholds);
+    snprintf(header.mandelName, sizeof(header.mandelName), "%s", getMandelName().c_str());
+    header.particleCount = config->particle_count;
+    header.iterCount = iterCount;
+    header.stepCount = stepCount;
+    setHeaderMode(header, config);
+}
+
+void startCheckpoint() {
+    if (checkpointBusy) {
+        return;
+    }
+
+    if (checkpointThread.joinable()) {
+        checkpointThread.join();
+    }
+
+    checkpointBusy = true;
+    lastCheckpoint = chrono::high_resolution_clock::now();
+
+    fillHeader(checkpoint.header);
+    allocateCheckpoint(checkpoint, config);
+    vector<cl_event> events;
+
+    if (cpuEngine) {
+        copy(cpuEngine->count.begin(), cpuEngine->count.end(), checkpoint.count.begin());
+        copy(cpuEngine->particles.begin(), cpuEngine->particles.end(), checkpoint.particles.begin());
+
+        for (size_t i = 0; i < cpuEngine->randomState.size(); i++) {
+            checkpoint.randomState[i] = cpuEngine->randomState[i].state;
+            checkpoint.randomIncrement[i] = cpuEngine->randomState[i].inc;
+        }
+    } else if (config->counter_rng) {
+        // The whole RNG state is the key and the launch counter
+        checkpoint.randomState[0] = rngSeed;
+        checkpoint.randomIncrement[0] = rngLaunch;
+
+        events.resize(2);
+        opencl->readBufferAsync("count", checkpoint.count.data(), &events[0]);
+        opencl->readBufferAsync("particles", checkpoint.particles.data(), &events[1]);
+        opencl->flush();
+    } else {
+        events.resize(4);
+        opencl->readBufferAsync("count", checkpoint.count.data(), &events[0]);
+        opencl->readBufferAsync("particles", checkpoint.particles.data(), &events[1]);
+        opencl->readBufferAsync("randomState", checkpoint.randomState.data(), &events[2]);
+        opencl->readBufferAsync("randomIncrement", checkpoint.randomIncrement.data(), &events[3]);
+        opencl->flush();
+    }
+
+    checkpointThread = thread([events]() {
+        if (!events.empty()) {
+            clWaitForEvents(events.size(), events.data());
+
+            for (cl_event event : events) {
+                clReleaseEvent(event);
+            }
+        }
+
+        writeCheckpoint(config->checkpoint_file.c_str(), checkpoint);
+        checkpointBusy = false;
+    });
+}
+
+void finishCheckpoint() {
+    if (checkpointThread.joinable()) {
+        checkpointThread.join();
+    }
+}
+
+void updateCheckpoint() {
+    if (config->checkpoint_interval <= 0) {
+        return;
+    }
+
+    chrono::duration<float> time_span = chrono::duration_cast<chrono::duration<float>>(chrono::high_resolution_clock::now() - lastCheckpoint);
+
+    if (time_span.count() >= config->checkpoint_interval) {
+        startCheckpoint();
+    }
+}
+
+void saveCheckpoint() {
+    if (config->checkpoint_interval <= 0) {
+        return;
+    }
+
+    finishCheckpoint();
+    startCheckpoint();
+    finishCheckpoint();
+}
+
+// Raw counts for merge.out, uses its own buffer so a running checkpoint isn't disturbed
+void dumpCounts() {
+    Checkpoint dump;
+    fillHeader(dump.header);
+    dump.count.resize(config->threshold_count * config->width * config->height);
+
+    fetchCounts(dump.count.data());
+    writeDump(config->dump_file.c_str(), dump);
+}
+
+bool resumeCheckpoint() {
+    if (!readCheckpoint(config->checkpoint_file.c_str(), checkpoint)) {
+        return false;
+    }
+
+    CheckpointHeader &header = checkpoint.header;
+
+    if (!matchesConfig(header, config) || !setMandelName(header.mandelName)) {
+        fprintf(stderr, "Checkpoint %s doesn't match the config, starting a fresh render\n", config->checkpoint_file.c_str());
+        return false;
+    }
+
+    viewFW = header.view;
+    applyView();
+
+    iterCount = header.iterCount;
+    stepCount = header.stepCount;
+
+    if (cpuEngine) {
+        copy(checkpoint.count.begin(), checkpoint.count.end(), cpuEngine->count.begin());
+        copy(checkpoint.count.begin(), checkpoint.count.end(), cpuEngine->prevCount.begin());
+        copy(checkpoint.particles.begin(), checkpoint.particles.end(), cpuEngine->particles.begin());
+
+        for (size_t i = 0; i < cpuEngine->randomState.size(); i++) {
+            cpuEngine->randomState[i].state = checkpoint.randomState[i];
+            cpuEngine->randomState[i].inc = checkpoint.randomIncrement[i];
+        }
+    } else {
+        opencl->writeBuffer("count", checkpoint.count.data());
+        opencl->writeBuffer("prevCount", checkpoint.count.data());
+        opencl->writeBuffer("particles", checkpoint.particles.data());
+
+        if (config->counter_rng) {
+            rngSeed = checkpoint.randomState[0];
+            rngLaunch = checkpoint.randomIncrement[0];
+        } else {
+            opencl->writeBuffer("randomState", checkpoint.randomState.data());
+            opencl->writeBuffer("randomIncrement", checkpoint.randomIncrement.data());
+        }
+
+        if (!config->replay_path) {
+            opencl->step("rewindParticles");
+        }
+    }
+
+    // The pool isn't checkpointed, but it was picked from these particles
+    if (settingsFW.crossPollinate) {
+        updatePool();
+    }
+
+    fprintf(stderr, "Resumed %s at %llu M samples\n", config->checkpoint_file.c_str(), (unsigned long long)(stepCount / 1000000LLU));
+
+    return true;
+}
+
+void buildCells() {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    sampleCells = buildSampleCells(config->sample_grid, config->thresholds[config->threshold_count - 1], config->thread_count);
+
+    if (config->verbose) {
+        float seconds = chrono::duration_cast<chrono::duration<float>>(chrono::high_resolution_clock::now() - start).count();
+        fprintf(stderr, "Sampling from %u of %u grid cells, built in %.2fs\n",
+            sampleCells[0], config->sample_grid * config->sample_grid, seconds);
+    }
+
+    // Nothing to draw from, fall back to the whole sampling rectangle
+    if (sampleCells[0] == 0) {
+        sampleCells.clear();
+    }
+}
+
+void prepare() {
+    if (config->seed != 0) {
+        pcg32_srandom(config->seed, 0);
+    } else {
+        pcg32_srandom(time(NULL) ^ (intptr_t)&printf, (intptr_t)&(config->particle_count));
+    }
 
     maximumCounts = (uint32_t *)malloc(config->threshold_count * sizeof(uint32_t));
+    pendingMaximum = (uint32_t *)malloc(config->threshold_count * sizeof(uint32_t));
+    pixelCount = config->width * config->height;
 
     float scaleY = config->scale;
     viewFW = {
@@ -263,59 +987,449 @@ void prepare() {
 
     defaultView = viewFW;
 
-    prepareOpenCl();
-}
+    settingsFW.pathType = config->path_type;
+    settingsFW.scoreType = config->score_type;
+    settingsFW.crossPollinate = config->cross_pollinate;
 
-void display() {
-    frameCount++;
-    opencl->startFrame();
+    // Only depends on the grid size and the largest threshold, so bench scenarios share it
+    if (config->sample_grid > 0 && sampleCells.empty()) {
+        buildCells();
+    }
 
-    if (frameCount % 2 == 0) {
-        return;
+    // Float atomics add the scores in any order, which deterministic runs can't have
+    importanceMap.clear();
+    importanceSteps = 0;
+    if (config->importance_map && !config->deterministic && !sampleCells.empty()) {
+        importanceMap = createImportanceMap(sampleCells, config->sample_grid);
     }
-    
-    displayFW();
 
-    char kernelName[50];
-    sprintf(kernelName, "mandelStep_%s", getMandelName().c_str());
+    if (config->cpu_engine) {
+        prepareCpuEngine();
+    } else {
+        prepareOpenCl();
+    }
+}
 
-    opencl->step(kernelName, config->frame_steps);
-    opencl->step("updateDiff");
+float cpuStepTime = 0;
 
-    if (settingsFW.showDiff) {
-        opencl->step("findMaxDiff");
-        opencl->step("findMax2");
-        opencl->step("renderImageD");
-    } else {
-        opencl->step("findMax1");
-        opencl->step("findMax2");
-        opencl->step("renderImage");
+void displayCpu() {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    stepMandel(frameSteps);
+    cpuStepTime = chrono::duration_cast<chrono::duration<float>>(chrono::high_resolution_clock::now() - start).count();
+
+    cpuEngine->updateDiff(config->alpha);
+    cpuEngine->findMax(settingsFW.showDiff, maximumCounts);
+
+    if (settingsFW.updateView) {
+        cpuEngine->renderImage(settingsFW.showDiff, maximumCounts, pixelsFW);
     }
-    
-    opencl->readBuffer("maximum", maximumCounts);
+}
+
+/**
+ * Enqueues a frame without waiting for it. renderImage writes into the
+ * image buffer that is not mapped, which is then mapped for reading. In the
+ * meantime displayFW uploads the still mapped image of the previous frame
+ * to the texture, and finishOpenCl waits for the frame and swaps the two.
+ */
+void enqueueOpenCl() {
+    stepMandel(frameSteps);
+    opencl->step("updateDiff");
+
+    string renderName = settingsFW.showDiff ? "renderImageD" : "renderImage";
+    opencl->setKernelBufferArg(renderName, 2, imageBuffers[imageIndex]);
+
+    opencl->step(settingsFW.showDiff ? "findMax2Diff" : "findMax2");
+    opencl->step(renderName);
+
+    opencl->readBufferAsync("maximum", pendingMaximum, &maximumEvent);
 
     if (settingsFW.updateView) {
-        opencl->readBuffer("image", pixelsFW);
+        pendingPixels = (uint32_t *)opencl->mapBufferAsync(imageBuffers[imageIndex], CL_MAP_READ, &imageEvent);
     }
 
     opencl->flush();
+}
+
+void unmapImage() {
+    if (mappedPixels) {
+        opencl->unmapBuffer(imageBuffers[mappedIndex], mappedPixels);
+        mappedPixels = NULL;
+    }
+}
+
+void finishOpenCl() {
+    clWaitForEvents(1, &maximumEvent);
+    clReleaseEvent(maximumEvent);
+    copy(pendingMaximum, pendingMaximum + config->threshold_count, maximumCounts);
+
+    if (pendingPixels) {
+        clWaitForEvents(1, &imageEvent);
+        clReleaseEvent(imageEvent);
+
+        // The previous image has been uploaded, so renderImage may write it again next frame
+        unmapImage();
+
+        mappedPixels = pendingPixels;
+        mappedIndex = imageIndex;
+        pendingPixels = NULL;
+        imageIndex = 1 - imageIndex;
+    }
+
+    opencl->endFrame();
+}
+
+/**
+ * Time the mandelStep kernels took last frame. The profiling events only
+ * cover the device, without them the whole frame is used.
+ */
+float getStepSeconds(float frameSeconds) {
+    if (cpuEngine) {
+        return cpuStepTime;
+    }
+
+    if (!config->profile) {
+        return frameSeconds;
+    }
+
+    float time = 0;
+
+    for (KernelTime &kernelTime : opencl->kernelTimes) {
+        if (kernelTime.name.rfind("mandel", 0) == 0 || kernelTime.name == "resetQueue") {
+            time += kernelTime.time;
+        }
+    }
+
+    return time / 1e6;
+}
+
+/**
+ * Sets the launches per frame so that steps launches taking stepSeconds
+ * would meet the target, changing by at most a factor 2 per frame so a
+ * single slow frame does not make it oscillate.
+ */
+void adaptFrameSteps(float stepSeconds, unsigned int steps, float targetMs) {
+    if (targetMs <= 0 || stepSeconds <= 0) {
+        return;
+    }
+
+    float target = targetMs / (1000 * stepSeconds) * steps;
+    frameSteps = max(1u, (unsigned int)round(min(2.f * frameSteps, max(0.5f * frameSteps, target))));
+}
+
+// Launches since the counts were reset, the budgets and the step counter use this instead of frames
+uint64_t getTotalSteps() {
+    return stepCount / ((uint64_t)config->particle_count * 4000);
+}
+
+void recordTelemetry(float seconds) {
+    if (telemetry) {
+        uint64_t samples = (uint64_t)frameSteps * config->particle_count * 4000;
+        telemetry->record(iterCount, seconds, samples, maximumCounts, opencl ? opencl->kernelTimes : noKernelTimes);
+    }
+}
+
+void display() {
+    frameCount++;
+
+    if (frameCount % 2 == 0) {
+        return;
+    }
+    
+    if (cpuEngine) {
+        displayFW();
+        displayCpu();
+    } else {
+        enqueueOpenCl();
+        displayFW();
+        finishOpenCl();
+    }
 
     iterCount++;
-    stepCount += config->frame_steps * config->particle_count * 4000;
+    stepCount += (uint64_t)frameSteps * config->particle_count * 4000;
 
     chrono::high_resolution_clock::time_point temp = chrono::high_resolution_clock::now();
     chrono::duration<float> time_span = chrono::duration_cast<chrono::duration<float>>(temp - timePoint);
     frameTime = time_span.count();
-    
-    fprintf(stderr, "Step = %d, time = %.4g            \n", frameCount / 2, frameTime);
-    fprintf(stderr, "\x1b[%dA", opencl->printCount + 1);
     timePoint = temp;
+
+    recordTelemetry(frameTime);
+    adaptFrameSteps(getStepSeconds(frameTime), frameSteps, config->target_frame_ms);
+
+    updateCheckpoint();
+}
+
+/**
+ * Headless rendering, runs the mandelStep kernels without a window until
+ * one of the budgets in the config is used up and then saves the image.
+ */
+
+bool budgetReached(float seconds) {
+    if (config->headless_steps > 0 && getTotalSteps() >= config->headless_steps) {
+        return true;
+    }
+
+    if (config->headless_seconds > 0 && seconds >= config->headless_seconds) {
+        return true;
+    }
+
+    if (config->headless_samples > 0 && stepCount / 1000000LLU >= config->headless_samples) {
+        return true;
+    }
+
+    return false;
+}
+
+void renderHeadless() {
+    if (cpuEngine) {
+        cpuEngine->findMax(false, maximumCounts);
+        cpuEngine->renderImage(false, maximumCounts, pixelsFW);
+        return;
+    }
+
+    opencl->step("findMax1");
+    opencl->step("findMax2");
+    opencl->step("renderImage");
+
+    opencl->readBuffer("maximum", maximumCounts);
+    opencl->readBuffer("image", pixelsFW);
+}
+
+void runBudget(bool checkpoints) {
+    chrono::high_resolution_clock::time_point startTime = chrono::high_resolution_clock::now();
+    chrono::high_resolution_clock::time_point frameStart = startTime;
+    float seconds = 0;
+
+    while (!budgetReached(seconds)) {
+        unsigned int steps = frameSteps;
+
+        // Never overshoot a step budget, so it stays exact with adaptive steps
+        if (config->headless_steps > 0) {
+            steps = min((uint64_t)steps, config->headless_steps - getTotalSteps());
+        }
+
+        stepMandel(steps);
+        finishSteps();
+
+        iterCount++;
+        stepCount += (uint64_t)steps * config->particle_count * 4000;
+
+        chrono::duration<float> time_span = chrono::duration_cast<chrono::duration<float>>(chrono::high_resolution_clock::now() - startTime);
+        seconds = time_span.count();
+
+        chrono::high_resolution_clock::time_point frameEnd = chrono::high_resolution_clock::now();
+        float frameSeconds = chrono::duration_cast<chrono::duration<float>>(frameEnd - frameStart).count();
+        frameStart = frameEnd;
+
+        recordTelemetry(frameSeconds);
+        adaptFrameSteps(cpuEngine ? frameSeconds : getStepSeconds(frameSeconds), steps, config->headless_frame_ms);
+
+        if (config->verbose) {
+            fprintf(stderr, "Step = %llu, samples = %llu M, time = %.1fs\n", (unsigned long long)getTotalSteps(), stepCount / 1000000LLU, seconds);
+        }
+
+        if (checkpoints) {
+            updateCheckpoint();
+        }
+    }
+}
+
+/**
+ * Tiled rendering. The buffers are sized for one tile and the tiles are
+ * rendered one after another with their own view, then stitched into the
+ * final PNG. The Metropolis sampler spends the same budget on every tile
+ * regardless of how much of the fractal it contains, so a preview of the
+ * whole view at tile resolution is rendered first and each tile is scaled
+ * to its share of the preview counts.
+ */
+
+uint32_t fullWidth, fullHeight;
+
+bool splitTiles() {
+    if (config->tiles_x == 0 || config->tiles_y == 0 || config->width % config->tiles_x != 0 || config->height % config->tiles_y != 0) {
+        fprintf(stderr, "width and height must be divisible by tiles_x and tiles_y\n");
+        return false;
+    }
+
+    fullWidth = config->width;
+    fullHeight = config->height;
+
+    config->width /= config->tiles_x;
+    config->height /= config->tiles_y;
+
+    return true;
+}
+
+ViewSettings getTileView(ViewSettings view, uint32_t tileX, uint32_t tileY) {
+    float u = (2. * (tileX + 0.5) / config->tiles_x - 1) * view.scaleX;
+    float v = (2. * (tileY + 0.5) / config->tiles_y - 1) * view.scaleY;
+
+    view.centerX += view.cosTheta * u + view.sinTheta * v;
+    view.centerY += -view.sinTheta * u + view.cosTheta * v;
+    view.scaleX /= config->tiles_x;
+    view.scaleY /= config->tiles_y;
+
+    return view;
+}
+
+void accumulateView(ViewSettings view, uint32_t *counts) {
+    viewFW = view;
+    applyView();
+    resetCounts();
+    resetParticles();
+
+    iterCount = 0;
+    stepCount = 0;
+
+    runBudget(false);
+    fetchCounts(counts);
+}
+
+string getTileFilename(uint32_t tileX, uint32_t tileY) {
+    return "images/tile_" + to_string(tileX) + "_" + to_string(tileY) + ".bin";
+}
+
+// Sum of the preview pixels whose centre falls inside the tile
+uint64_t getPreviewShare(vector<uint32_t> &preview, unsigned int threshold, uint32_t tileX, uint32_t tileY) {
+    uint64_t share = 0;
+
+    for (uint32_t y = 0; y < config->height; y++) {
+        if ((y * config->tiles_y + config->tiles_y / 2) / config->height != tileY) {
+            continue;
+        }
+
+        for (uint32_t x = 0; x < config->width; x++) {
+            if ((x * config->tiles_x + config->tiles_x / 2) / config->width == tileX) {
+                share += preview[threshold * pixelCount + config->width * y + x];
+            }
+        }
+    }
+
+    return share;
+}
+
+int runTiled() {
+    const uint32_t tileCount = config->tiles_x * config->tiles_y;
+    ViewSettings fullView = viewFW;
+
+    vector<uint32_t> preview(config->threshold_count * pixelCount);
+    vector<uint32_t> counts(config->threshold_count * pixelCount);
+    vector<double> weights(tileCount * config->threshold_count, 0);
+    vector<double> maximum(config->threshold_count, 0);
+
+    fprintf(stderr, "Rendering preview\n");
+    accumulateView(fullView, preview.data());
+
+    for (uint32_t tileY = 0; tileY < config->tiles_y; tileY++) {
+        for (uint32_t tileX = 0; tileX < config->tiles_x; tileX++) {
+            const uint32_t tile = config->tiles_x * tileY + tileX;
+            fprintf(stderr, "Rendering tile %d / %d\n", tile + 1, tileCount);
+
+            accumulateView(getTileView(fullView, tileX, tileY), counts.data());
+
+            for (unsigned int i = 0; i < config->threshold_count; i++) {
+                uint64_t tileSum = 0;
+                uint32_t tileMax = 0;
+
+                for (uint32_t j = i * pixelCount; j < (i + 1) * pixelCount; j++) {
+                    tileSum += counts[j];
+                    tileMax = max(tileMax, counts[j]);
+                }
+
+                double weight = tileSum > 0 ? (double)getPreviewShare(preview, i, tileX, tileY) / tileSum : 0;
+                weights[tile * config->threshold_count + i] = weight;
+                maximum[i] = max(maximum[i], weight * tileMax);
+            }
+
+            Checkpoint dump;
+            fillHeader(dump.header);
+            dump.count = counts;
+            writeDump(getTileFilename(tileX, tileY).c_str(), dump);
+        }
+    }
+
+    // Second pass once the global maxima are known, only one tile is in memory at a time
+    vector<unsigned char> image(3 * (size_t)fullWidth * fullHeight);
+    vector<double> scaled(config->threshold_count * pixelCount);
+    pixelsFW = (uint32_t *)malloc(3 * pixelCount * sizeof(uint32_t));
+
+    for (uint32_t tileY = 0; tileY < config->tiles_y; tileY++) {
+        for (uint32_t tileX = 0; tileX < config->tiles_x; tileX++) {
+            const uint32_t tile = config->tiles_x * tileY + tileX;
+            string filename = getTileFilename(tileX, tileY);
+
+            Checkpoint dump;
+            if (!readDump(filename.c_str(), dump)) {
+                return 1;
+            }
+
+            for (unsigned int i = 0; i < config->threshold_count; i++) {
+                for (uint32_t j = i * pixelCount; j < (i + 1) * pixelCount; j++) {
+                    scaled[j] = weights[tile * config->threshold_count + i] * dump.count[j];
+                }
+            }
+
+            renderCounts(scaled.data(), maximum.data(), config->threshold_count, pixelCount, pixelsFW, 0, pixelCount);
+            copyRgb8(pixelsFW, config->width, config->height, image.data(), fullWidth, fullHeight, tileX * config->width, tileY * config->height);
+
+            remove(filename.c_str());
+        }
+    }
+
+    fullView.sizeX = fullWidth;
+    fullView.sizeY = fullHeight;
+    writePngRgb8(getPngFilename(getMandelName(), fullView).c_str(), image.data(), fullWidth, fullHeight);
+
+    free(pixelsFW);
+    releaseBackend();
+
+    return 0;
+}
+
+void saveTelemetry() {
+    if (telemetry && !config->telemetry_file.empty()) {
+        telemetry->save(config->telemetry_file);
+    }
+}
+
+int runHeadless() {
+    if (config->headless_steps == 0 && config->headless_seconds <= 0 && config->headless_samples == 0) {
+        fprintf(stderr, "Headless mode needs headless_steps, headless_seconds or headless_samples to be set\n");
+        return 1;
+    }
+
+    if (config->tiles_x * config->tiles_y > 1) {
+        return runTiled();
+    }
+
+    pixelsFW = (uint32_t *)malloc(getImageSize(config->output_bits, config->width * config->height));
+
+    runBudget(true);
+    saveCheckpoint();
+
+    if (!config->dump_file.empty()) {
+        dumpCounts();
+    }
+
+    renderHeadless();
+    writePng(getPngFilename(getMandelName(), viewFW).c_str(), pixelsFW, config->width, config->height, config->output_bits);
+    saveTelemetry();
+
+    free(pixelsFW);
+    releaseBackend();
+
+    return 0;
 }
 
 void cleanAll() {
-    fprintf(stderr, "\n\n\n\n\n\n\nExiting\n");
+    fprintf(stderr, "Exiting\n");
+    saveCheckpoint();
+    saveTelemetry();
     destroyFractalWindow();
-    opencl->cleanup();
+
+    if (opencl) {
+        unmapImage();
+        opencl->cleanup();
+    }
 }
 
 static void glfwHandleErrors(int error, const char* description)
@@ -323,21 +1437,68 @@ static void glfwHandleErrors(int error, const char* description)
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
 
-int main() {
+int main(int argc, char **argv) {
     config = new Config("config.cfg");
+    bool checkResume = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            config->headless = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            config->bench = true;
+        } else if (strcmp(argv[i], "--check-resume") == 0) {
+            checkResume = true;
+        } else if (strcmp(argv[i], "--use-cpu") == 0) {
+            config->use_gpu = false;
+        } else if (strcmp(argv[i], "--cpu-engine") == 0) {
+            config->cpu_engine = true;
+        }
+    }
+
+    if (config->output_bits != 8 && config->output_bits != 16 && config->output_bits != 32) {
+        fprintf(stderr, "output_bits must be 8, 16 or 32, using 8\n");
+        config->output_bits = 8;
+    }
+
+    unsigned int unroll = getValidUnroll(config->unroll);
+    if (unroll != config->unroll) {
+        fprintf(stderr, "unroll = %u doesn't line up with the thresholds or doesn't divide 4000, using %u\n", config->unroll, unroll);
+        config->unroll = unroll;
+    }
+
     config->printValues();
+    frameSteps = max(1u, config->frame_steps);
 
-    int remainder = config->width * config->height % config->maximum_size;
+    if (config->bench) {
+        return runBenchmarks();
+    }
 
-    if (remainder != 0) {
-        fprintf(stderr, "image size (%d) %% sampling size (%d) != 0 (%d)\n", config->width * config->height, config->maximum_size, remainder);
-        return 1;
+    if (checkResume) {
+        return runResumeCheck();
     }
 
-    maximaKernelSize = (config->width * config->height / config->maximum_size);
     timePoint = chrono::high_resolution_clock::now();
 
+    if (config->telemetry) {
+        telemetry = new Telemetry(config->threshold_count);
+    }
+
+    if (config->headless && config->tiles_x * config->tiles_y > 1 && !splitTiles()) {
+        return 1;
+    }
+
     prepare();
+
+    if (config->resume) {
+        resumeCheckpoint();
+    }
+
+    lastCheckpoint = chrono::high_resolution_clock::now();
+
+    if (config->headless) {
+        return runHeadless();
+    }
+
     atexit(&cleanAll);
 
     glfwSetErrorCallback(glfwHandleErrors);
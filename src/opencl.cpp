@@ -1,7 +1,9 @@
-#include <chrono>
+#include <algorithm>
 #include <map>
 #include <stdio.h>
+#include <string.h>
 #include <string>
+#include <sys/stat.h>
 #include <vector>
 
 #include "opencl.hpp"
@@ -14,9 +16,13 @@ OpenCl::OpenCl(
     vector<KernelSpec> kernelSpecs,
     bool profile,
     bool useGpu,
-    bool verbose
+    bool verbose,
+    string buildOptions,
+    string cacheDir
 ) {
     this->filename = filename;
+    this->build_options = buildOptions;
+    this->cache_dir = cacheDir;
     this->use_gpu = useGpu;
     this->profile = profile;
     this->verbose = verbose;
@@ -38,6 +44,13 @@ void OpenCl::prepare(vector<BufferSpec> bufferSpecs, vector<KernelSpec> kernelSp
     
     setDevice();
 
+    char deviceName[256] = "", driverVersion[256] = "";
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+    device_key = string(deviceName) + "|" + driverVersion;
+
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, NULL);
+
     // Create OpenCL Context
     context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &ret);
     if (ret != CL_SUCCESS)
@@ -54,7 +67,7 @@ void OpenCl::prepare(vector<BufferSpec> bufferSpecs, vector<KernelSpec> kernelSp
     for (BufferSpec bufferSpec : bufferSpecs) {
         bufferSpec.buffer.buffer = clCreateBuffer(
             context,
-            CL_MEM_READ_WRITE,
+            CL_MEM_READ_WRITE | bufferSpec.buffer.flags,
             bufferSpec.buffer.size,
             NULL, &ret
         );
@@ -65,31 +78,178 @@ void OpenCl::prepare(vector<BufferSpec> bufferSpecs, vector<KernelSpec> kernelSp
         buffers[bufferSpec.name] = bufferSpec.buffer;
     }
 
+    program = buildProgram("");
+
+    // Create kernels
+    for (KernelSpec kernelSpec : kernelSpecs) {
+        kernelSpec.kernel.kernel = clCreateKernel(program, kernelSpec.kernel.name.c_str(), &ret);
+
+        if (ret != CL_SUCCESS)
+            fprintf(stderr, "Failed on function clCreateKernel %s: %d\n", kernelSpec.name.c_str(), ret);
+        
+        kernels[kernelSpec.name] = kernelSpec.kernel;
+    }
+}
+
+/**
+ * Builds the source with build_options plus the given options, or returns
+ * the program from an earlier call with the same options.
+ */
+cl_program OpenCl::buildProgram(string options) {
+    if (programs.count(options)) {
+        return programs[options];
+    }
+
+    string fullOptions = build_options + " " + options;
+    string cacheFile = getCacheFile(fullOptions);
+
+    if (!cacheFile.empty()) {
+        cl_program cached = loadCachedProgram(cacheFile, fullOptions);
+
+        if (cached) {
+            programs[options] = cached;
+            return cached;
+        }
+    }
+
     // Create kernel program from source file
-    program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &ret);
+    cl_program newProgram = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &ret);
     if (ret != CL_SUCCESS)
         fprintf(stderr, "Failed on function clCreateProgramWithSource: %d\n", ret);
     
-    ret = clBuildProgram(program, 1, &device_id, NULL, NULL, NULL);
+    // Kept apart from ret, which the build log queries below overwrite
+    cl_int buildStatus = clBuildProgram(newProgram, 1, &device_id, fullOptions.c_str(), NULL, NULL);
+    ret = buildStatus;
     if (ret != CL_SUCCESS)
         fprintf(stderr, "Failed on function clBuildProgram: %d\n", ret);
     
     // Check program build info
     size_t len = 10000;
-    ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+    ret = clGetProgramBuildInfo(newProgram, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
     char *buffer = (char *)calloc(len, sizeof(char));
-    ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
-    fprintf(stderr, "Build info:\n%s\n", buffer);
+    ret = clGetProgramBuildInfo(newProgram, device_id, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
 
-    // Create kernels
-    for (KernelSpec kernelSpec : kernelSpecs) {
-        kernelSpec.kernel.kernel = clCreateKernel(program, kernelSpec.kernel.name.c_str(), &ret);
+    if (verbose) {
+        fprintf(stderr, "Build info [%s]:\n%s\n", fullOptions.c_str(), buffer);
+    }
 
-        if (ret != CL_SUCCESS)
-            fprintf(stderr, "Failed on function clCreateKernel %s: %d\n", kernelSpec.name.c_str(), ret);
-        
-        kernels[kernelSpec.name] = kernelSpec.kernel;
+    free(buffer);
+
+    if (buildStatus == CL_SUCCESS && !cacheFile.empty()) {
+        saveCachedProgram(cacheFile, newProgram);
+    }
+
+    programs[options] = newProgram;
+    return newProgram;
+}
+
+/**
+ * Program binary cache. The file name is an FNV-1a hash of everything that
+ * affects the binary, so a changed source, driver or option simply misses
+ * and the fresh build is stored next to the stale one.
+ */
+string OpenCl::getCacheFile(string options) {
+    if (cache_dir.empty()) {
+        return "";
+    }
+
+    string key = string(source_str, source_size) + "|" + device_key + "|" + options;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+
+    return cache_dir + "/" + name;
+}
+
+// Returns NULL when there is no usable binary, the caller then builds from source
+cl_program OpenCl::loadCachedProgram(string cacheFile, string options) {
+    FILE *fp = fopen(cacheFile.c_str(), "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *binary = (unsigned char *)malloc(size);
+    size_t readSize = fread(binary, 1, size, fp);
+    fclose(fp);
+
+    cl_program cached = NULL;
+    cl_int binaryStatus = CL_INVALID_BINARY;
+
+    if (readSize == size && size > 0) {
+        cached = clCreateProgramWithBinary(context, 1, &device_id, &size, (const unsigned char **)&binary, &binaryStatus, &ret);
+    }
+
+    free(binary);
+
+    if (cached && (ret != CL_SUCCESS || binaryStatus != CL_SUCCESS || clBuildProgram(cached, 1, &device_id, options.c_str(), NULL, NULL) != CL_SUCCESS)) {
+        clReleaseProgram(cached);
+        cached = NULL;
+    }
+
+    if (verbose) {
+        fprintf(stderr, cached ? "Loaded cached program %s\n" : "Cached program %s is stale, rebuilding\n", cacheFile.c_str());
+    }
+
+    return cached;
+}
+
+// Writes to a temporary file first, so parallel runs never read a partial binary
+void OpenCl::saveCachedProgram(string cacheFile, cl_program program) {
+    size_t size = 0;
+    clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL);
+
+    if (size == 0) {
+        return;
+    }
+
+    unsigned char *binary = (unsigned char *)malloc(size);
+    ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL);
+
+    mkdir(cache_dir.c_str(), 0755);
+
+    string tmpFile = cacheFile + ".tmp";
+    FILE *fp = fopen(tmpFile.c_str(), "wb");
+
+    if (ret == CL_SUCCESS && fp) {
+        bool success = fwrite(binary, 1, size, fp) == size;
+        fclose(fp);
+
+        if (success) {
+            rename(tmpFile.c_str(), cacheFile.c_str());
+        } else {
+            remove(tmpFile.c_str());
+        }
+    } else if (fp) {
+        fclose(fp);
+        remove(tmpFile.c_str());
     }
+
+    free(binary);
+}
+
+// Creates a kernel from the program built with the extra options, the kernel args still have to be set
+void OpenCl::createKernel(KernelSpec kernelSpec, string options) {
+    cl_program kernelProgram = buildProgram(options);
+
+    kernelSpec.kernel.kernel = clCreateKernel(kernelProgram, kernelSpec.kernel.name.c_str(), &ret);
+
+    if (ret != CL_SUCCESS)
+        fprintf(stderr, "Failed on function clCreateKernel %s: %d\n", kernelSpec.name.c_str(), ret);
+
+    kernels[kernelSpec.name] = kernelSpec.kernel;
+}
+
+bool OpenCl::hasKernel(string name) {
+    return kernels.count(name) > 0;
 }
 
 void OpenCl::setDevice() {
@@ -159,38 +319,28 @@ void OpenCl::writeBuffer(string name, void *pointer) {
     }
 }
 
+/**
+ * Only enqueues the kernel, the host never waits here. When profiling, an
+ * event is kept for every launch and resolved in endFrame.
+ */
 void OpenCl::step(string name, int count) {
     OpenClKernel kernel = kernels[name];
-
-    startTimer();
+    const size_t *localSize = kernel.local_size[0] > 0 ? kernel.local_size : NULL;
 
     for (int i = 0; i < count; i++) {
-        if (kernel.local_size[0] > 0) {
-            ret = clEnqueueNDRangeKernel(command_queue, kernel.kernel, kernel.work_dim, NULL, kernel.global_size, kernel.local_size, 0, NULL, NULL);
-        } else {
-            ret = clEnqueueNDRangeKernel(command_queue, kernel.kernel, kernel.work_dim, NULL, kernel.global_size, NULL, 0, NULL, NULL);
-        }
+        cl_event event;
+
+        ret = clEnqueueNDRangeKernel(command_queue, kernel.kernel, kernel.work_dim, NULL, kernel.global_size, localSize, 0, NULL, profile ? &event : NULL);
         
         if (ret != CL_SUCCESS) {
             fprintf(stderr, "Failed executing kernel [%s]: %d\n", name.c_str(), ret);
             exit(1);
         }
-    }
-
-    getTime();
-    fprintf(stderr, "%s ", name.c_str());
-    for (int i = strlen(name.c_str()); i < 30; i++) {
-        fprintf(stderr, " ");
-    }
 
-    fprintf(stderr, "Chrono = %09.1fμs", chronoTime);
-    
-    if (profile) {
-        fprintf(stderr, "OpenCL = %09.1fμs", clTime);
+        if (profile) {
+            frameEvents.push_back({name, event});
+        }
     }
-
-    fprintf(stderr, "\n");
-    printCount++;
 }
 
 void OpenCl::readBuffer(string name, void *pointer) {
@@ -205,13 +355,72 @@ void OpenCl::readBuffer(string name, void *pointer) {
     );
 }
 
+// The pointer has to stay valid until the event completes
+void OpenCl::readBufferAsync(string name, void *pointer, cl_event *event) {
+    ret = clEnqueueReadBuffer(
+        command_queue,
+        buffers[name].buffer,
+        CL_FALSE,
+        0,
+        buffers[name].size,
+        pointer,
+        0, NULL, event
+    );
+
+    if (ret != CL_SUCCESS) {
+        fprintf(stderr, "Failed reading buffer [%s]: %d\n", name.c_str(), ret);
+    }
+}
+
+// Copies as much of source as fits in target, without blocking
+void OpenCl::copyBuffer(string source, string target) {
+    size_t size = min(buffers[source].size, buffers[target].size);
+    ret = clEnqueueCopyBuffer(command_queue, buffers[source].buffer, buffers[target].buffer, 0, 0, size, 0, NULL, NULL);
+
+    if (ret != CL_SUCCESS) {
+        fprintf(stderr, "Failed copying buffer [%s] to [%s]: %d\n", source.c_str(), target.c_str(), ret);
+    }
+}
+
+/**
+ * Maps the whole buffer once the commands before it have run. The pointer
+ * is only valid after the event completes and until unmapBuffer.
+ */
+void *OpenCl::mapBufferAsync(string name, cl_map_flags flags, cl_event *event) {
+    void *pointer = clEnqueueMapBuffer(command_queue, buffers[name].buffer, CL_FALSE, flags, 0, buffers[name].size, 0, NULL, event, &ret);
+
+    if (ret != CL_SUCCESS) {
+        fprintf(stderr, "Failed mapping buffer [%s]: %d\n", name.c_str(), ret);
+        exit(1);
+    }
+
+    return pointer;
+}
+
+void OpenCl::unmapBuffer(string name, void *pointer) {
+    ret = clEnqueueUnmapMemObject(command_queue, buffers[name].buffer, pointer, 0, NULL, NULL);
+
+    if (ret != CL_SUCCESS) {
+        fprintf(stderr, "Failed unmapping buffer [%s]: %d\n", name.c_str(), ret);
+    }
+}
+
 void OpenCl::cleanup() {
     map<string, OpenClKernel>::iterator kernelIter;
     map<string, OpenClBuffer>::iterator bufferIter;
+    map<string, cl_program>::iterator programIter;
     
     ret = clFlush(command_queue);
     ret = clFinish(command_queue);
-    ret = clReleaseProgram(program);
+
+    for (programIter = programs.begin(); programIter != programs.end(); programIter++) {
+        ret = clReleaseProgram(programIter->second);
+    }
+
+    for (KernelEvent kernelEvent : frameEvents) {
+        clReleaseEvent(kernelEvent.event);
+    }
+    frameEvents.clear();
 
     for (kernelIter = kernels.begin(); kernelIter != kernels.end(); kernelIter++) {
         ret = clReleaseKernel(kernelIter->second.kernel);
@@ -231,6 +440,10 @@ void OpenCl::flush() {
     clFlush(command_queue);
 }
 
+void OpenCl::finish() {
+    clFinish(command_queue);
+}
+
 void OpenCl::printDeviceTypes() {
     for (int i = 0; i < ret_num_platforms; i++) {
         getDeviceIds(platform_ids[i]);
@@ -279,32 +492,27 @@ void OpenCl::getDeviceIds(cl_platform_id platformId) {
     }
 }
 
-void OpenCl::startTimer() {
-    if (profile) {
-        clReleaseEvent(timer_event);
-        ret = clEnqueueMarkerWithWaitList(command_queue, 0, NULL, &timer_event);
-    }
-
-    startingTime = chrono::high_resolution_clock::now();
-}
-
-void OpenCl::getTime() {
-    clFinish(command_queue);
-
-    std::chrono::high_resolution_clock::time_point endTime = chrono::high_resolution_clock::now();
-    chrono::duration<float> time_span = chrono::duration_cast<chrono::duration<float>>(endTime - startingTime);
-    chronoTime = time_span.count() * 1000000.;
+/**
+ * Collects the kernel timings of the frame. Call this after the final
+ * blocking read of the frame, at which point all events have completed.
+ */
+void OpenCl::endFrame() {
+    kernelTimes.clear();
 
-    if (profile) {
+    for (KernelEvent kernelEvent : frameEvents) {
         cl_ulong start, end;
 
-        clGetEventProfilingInfo(timer_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-        clGetEventProfilingInfo(timer_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clGetEventProfilingInfo(kernelEvent.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(kernelEvent.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(kernelEvent.event);
+
+        if (kernelTimes.empty() || kernelTimes.back().name != kernelEvent.name) {
+            kernelTimes.push_back({kernelEvent.name, 0, 0});
+        }
 
-        clTime = (float)(end - start) / 1000.;
+        kernelTimes.back().time += (float)(end - start) / 1000.;
+        kernelTimes.back().launches++;
     }
-}
 
-void OpenCl::startFrame() {
-    printCount = 0;
+    frameEvents.clear();
 }
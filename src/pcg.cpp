@@ -120,4 +120,8 @@ double inverseNormalCdf(double uniform) {
 
 double RANDN() {
     return inverseNormalCdf(UNI());
-}
\ No newline at end of file
+}
+
+double RANDN_r(pcg32_random_t* rng) {
+    return inverseNormalCdf(UNI_r(rng));
+}
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "coordinates.hpp"
+#include "sampleGrid.hpp"
+
+using namespace std;
+
+// Float orbits like the kernels, exact repeats are caught with Brent's algorithm
+bool isBounded(FractalCoordinate c, unsigned int maxLength) {
+    FractalCoordinate z = c;
+    FractalCoordinate ref = c;
+    unsigned int power = 1, length = 0;
+
+    for (unsigned int i = 0; i < maxLength; i++) {
+        if (complex_norm2(z) > 4) {
+            return false;
+        }
+
+        z = complex_square(z) + c;
+
+        if (z.x == ref.x && z.y == ref.y) {
+            return true;
+        }
+
+        if (++length == power) {
+            ref = z;
+            power *= 2;
+            length = 0;
+        }
+    }
+
+    return true;
+}
+
+// Nearest point of the cell to the origin is outside the radius 2 disc
+bool isOutside(float x0, float y0, float size) {
+    float x = clamp(0.f, x0, x0 + size);
+    float y = clamp(0.f, y0, y0 + size);
+
+    return x * x + y * y >= 4;
+}
+
+vector<uint32_t> buildSampleCells(unsigned int gridSize, unsigned int maxLength, unsigned int threadCount) {
+    const unsigned int linePoints = gridSize * SAMPLE_EDGE_POINTS + 1;
+    const float cellSize = SAMPLE_GRID_RANGE / gridSize;
+    const float pointStep = cellSize / SAMPLE_EDGE_POINTS;
+
+    // Orbits along the horizontal and vertical grid lines, shared by neighbouring cells
+    vector<uint8_t> rows((gridSize + 1) * linePoints);
+    vector<uint8_t> columns((gridSize + 1) * linePoints);
+
+    threadCount = threadCount > 0 ? threadCount : max(1u, thread::hardware_concurrency());
+    vector<thread> workers;
+
+    for (unsigned int t = 0; t < threadCount; t++) {
+        workers.push_back(thread([&, t]() {
+            for (unsigned int line = t; line <= gridSize; line += threadCount) {
+                const float lineCoord = SAMPLE_GRID_MIN + line * cellSize;
+
+                for (unsigned int i = 0; i < linePoints; i++) {
+                    const float pointCoord = SAMPLE_GRID_MIN + i * pointStep;
+
+                    rows[line * linePoints + i] = isBounded({pointCoord, lineCoord}, maxLength);
+                    columns[line * linePoints + i] = isBounded({lineCoord, pointCoord}, maxLength);
+                }
+            }
+        }));
+    }
+
+    for (thread &worker : workers) {
+        worker.join();
+    }
+
+    // Cells with an escaping orbit somewhere on their border
+    vector<uint8_t> escaping(gridSize * gridSize);
+
+    for (unsigned int y = 0; y < gridSize; y++) {
+        for (unsigned int x = 0; x < gridSize; x++) {
+            bool interior = true;
+
+            for (unsigned int i = 0; i <= SAMPLE_EDGE_POINTS && interior; i++) {
+                interior = rows[y * linePoints + x * SAMPLE_EDGE_POINTS + i]
+                    && rows[(y + 1) * linePoints + x * SAMPLE_EDGE_POINTS + i]
+                    && columns[x * linePoints + y * SAMPLE_EDGE_POINTS + i]
+                    && columns[(x + 1) * linePoints + y * SAMPLE_EDGE_POINTS + i];
+            }
+
+            escaping[y * gridSize + x] = !interior;
+        }
+    }
+
+    vector<uint32_t> cells = {0};
+
+    for (unsigned int y = 0; y < gridSize; y++) {
+        for (unsigned int x = 0; x < gridSize; x++) {
+            if (isOutside(SAMPLE_GRID_MIN + x * cellSize, SAMPLE_GRID_MIN + y * cellSize, cellSize)) {
+                continue;
+            }
+
+            // A channel thinner than the point spacing can slip past the border
+            // test, but it has to reach the exterior through a neighbour
+            bool keep = false;
+
+            for (unsigned int ny = y > 0 ? y - 1 : 0; ny <= min(y + 1, gridSize - 1) && !keep; ny++) {
+                for (unsigned int nx = x > 0 ? x - 1 : 0; nx <= min(x + 1, gridSize - 1) && !keep; nx++) {
+                    keep = escaping[ny * gridSize + nx];
+                }
+            }
+
+            if (keep) {
+                cells.push_back(y * gridSize + x);
+            }
+        }
+    }
+
+    cells[0] = cells.size() - 1;
+
+    return cells;
+}
+
+vector<uint32_t> createImportanceMap(const vector<uint32_t> &cells, unsigned int gridSize) {
+    const uint32_t cellCount = cells[0];
+    const uint32_t tableSize = cellCount * SAMPLE_TABLE_SCALE;
+
+    // Zero bits are 0.f, so the scores start out empty
+    vector<uint32_t> map(1 + tableSize + 2 * gridSize * gridSize, 0);
+    map[0] = tableSize;
+
+    for (uint32_t i = 0; i < tableSize; i++) {
+        map[1 + i] = cells[1 + i / SAMPLE_TABLE_SCALE];
+    }
+
+    fill(map.begin() + 1 + tableSize, map.begin() + 1 + tableSize + gridSize * gridSize, SAMPLE_TABLE_SCALE);
+
+    return map;
+}
+
+void updateImportanceMap(vector<uint32_t> &map, const vector<uint32_t> &cells, unsigned int gridSize) {
+    const uint32_t cellCount = cells[0];
+    const uint32_t tableSize = map[0];
+    uint32_t *density = &map[1 + tableSize];
+
+    vector<float> scores(gridSize * gridSize);
+    memcpy(scores.data(), density + gridSize * gridSize, scores.size() * sizeof(float));
+
+    double total = 0;
+    for (uint32_t i = 0; i < cellCount; i++) {
+        total += scores[cells[1 + i]];
+    }
+
+    vector<uint32_t> entries(cellCount, SAMPLE_TABLE_SCALE);
+
+    if (total > 0) {
+        const uint32_t extra = tableSize - cellCount;
+        vector<double> remainder(cellCount);
+        uint32_t used = 0;
+
+        for (uint32_t i = 0; i < cellCount; i++) {
+            double share = extra * (scores[cells[1 + i]] / total);
+            entries[i] = 1 + (uint32_t)share;
+            remainder[i] = share - floor(share);
+            used += entries[i];
+        }
+
+        // The entries lost to rounding go to the largest remainders
+        uint32_t left = tableSize > used ? tableSize - used : 0;
+
+        if (left > 0) {
+            vector<uint32_t> order(cellCount);
+            iota(order.begin(), order.end(), 0);
+            nth_element(order.begin(), order.begin() + left - 1, order.end(), [&](uint32_t a, uint32_t b) {
+                return remainder[a] > remainder[b];
+            });
+
+            for (uint32_t i = 0; i < left; i++) {
+                entries[order[i]]++;
+            }
+        }
+    }
+
+    fill(density, density + gridSize * gridSize, SAMPLE_TABLE_SCALE);
+    uint32_t next = 0;
+
+    for (uint32_t i = 0; i < cellCount; i++) {
+        density[cells[1 + i]] = entries[i];
+
+        for (uint32_t j = 0; j < entries[i] && next < tableSize; j++) {
+            map[1 + next++] = cells[1 + i];
+        }
+    }
+
+    for (float &score : scores) {
+        score *= IMPORTANCE_DECAY;
+    }
+
+    memcpy(density + gridSize * gridSize, scores.data(), scores.size() * sizeof(float));
+}
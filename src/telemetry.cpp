@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "telemetry.hpp"
+
+using namespace std;
+
+Telemetry::Telemetry(unsigned int thresholdCount) {
+    threshold_count = min(thresholdCount, (unsigned int)TELEMETRY_THRESHOLDS);
+    kernelNames.reserve(TELEMETRY_KERNELS);
+}
+
+int Telemetry::getKernelIndex(string &name) {
+    for (size_t i = 0; i < kernelNames.size(); i++) {
+        if (kernelNames[i] == name) {
+            return i;
+        }
+    }
+
+    if (kernelNames.size() == TELEMETRY_KERNELS) {
+        return -1;
+    }
+
+    kernelNames.push_back(name);
+
+    // Earlier frames did not run this kernel
+    for (unsigned int i = 0; i < TELEMETRY_FRAMES; i++) {
+        frames[i].kernelTimes[kernelNames.size() - 1] = 0;
+    }
+
+    return kernelNames.size() - 1;
+}
+
+void Telemetry::record(uint32_t frame, float frameTime, uint64_t samples, uint32_t *maximumCounts, vector<KernelTime> &kernelTimes) {
+    TelemetryFrame &target = frames[head];
+
+    target.frame = frame;
+    target.frameTime = 1000 * frameTime;
+    target.samples = samples;
+
+    for (unsigned int i = 0; i < threshold_count; i++) {
+        target.maximumCounts[i] = maximumCounts[i];
+    }
+
+    fill(target.kernelTimes, target.kernelTimes + TELEMETRY_KERNELS, 0.f);
+
+    for (KernelTime &kernelTime : kernelTimes) {
+        int index = getKernelIndex(kernelTime.name);
+
+        if (index >= 0) {
+            target.kernelTimes[index] += kernelTime.time;
+        }
+    }
+
+    head = (head + 1) % TELEMETRY_FRAMES;
+    frameCount = min(frameCount + 1, (unsigned int)TELEMETRY_FRAMES);
+}
+
+void Telemetry::clear() {
+    frameCount = 0;
+    head = 0;
+}
+
+unsigned int Telemetry::offset() {
+    return frameCount < TELEMETRY_FRAMES ? 0 : head;
+}
+
+// i = 0 is the oldest recorded frame
+TelemetryFrame &Telemetry::getFrame(unsigned int i) {
+    return frames[(offset() + i) % TELEMETRY_FRAMES];
+}
+
+// The extension picks the format, anything but .json is written as CSV
+bool Telemetry::save(string filename) {
+    if (filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0) {
+        return saveJson(filename.c_str());
+    }
+
+    return saveCsv(filename.c_str());
+}
+
+bool Telemetry::saveCsv(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename);
+        return false;
+    }
+
+    fprintf(fp, "frame,frame_ms,samples");
+    for (unsigned int i = 0; i < threshold_count; i++) {
+        fprintf(fp, ",max_%u", i);
+    }
+    for (string &name : kernelNames) {
+        fprintf(fp, ",%s_us", name.c_str());
+    }
+    fprintf(fp, "\n");
+
+    for (unsigned int i = 0; i < frameCount; i++) {
+        TelemetryFrame &frame = getFrame(i);
+
+        fprintf(fp, "%u,%.3f,%llu", frame.frame, frame.frameTime, (unsigned long long)frame.samples);
+        for (unsigned int j = 0; j < threshold_count; j++) {
+            fprintf(fp, ",%.0f", frame.maximumCounts[j]);
+        }
+        for (size_t j = 0; j < kernelNames.size(); j++) {
+            fprintf(fp, ",%.1f", frame.kernelTimes[j]);
+        }
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+    fprintf(stderr, "Saved %s\n", filename);
+
+    return true;
+}
+
+bool Telemetry::saveJson(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename);
+        return false;
+    }
+
+    fprintf(fp, "[\n");
+
+    for (unsigned int i = 0; i < frameCount; i++) {
+        TelemetryFrame &frame = getFrame(i);
+
+        fprintf(fp, "  {\"frame\": %u, \"frame_ms\": %.3f, \"samples\": %llu, \"maximum\": [",
+            frame.frame, frame.frameTime, (unsigned long long)frame.samples);
+        for (unsigned int j = 0; j < threshold_count; j++) {
+            fprintf(fp, "%s%.0f", j > 0 ? ", " : "", frame.maximumCounts[j]);
+        }
+        fprintf(fp, "], \"kernels_us\": {");
+        for (size_t j = 0; j < kernelNames.size(); j++) {
+            fprintf(fp, "%s\"%s\": %.1f", j > 0 ? ", " : "", kernelNames[j].c_str(), frame.kernelTimes[j]);
+        }
+        fprintf(fp, "}}%s\n", i + 1 < frameCount ? "," : "");
+    }
+
+    fprintf(fp, "]\n");
+    fclose(fp);
+    fprintf(stderr, "Saved %s\n", filename);
+
+    return true;
+}
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.hpp"
+#include "image.hpp"
+
+using namespace std;
+
+/**
+ * Sums the count dumps of independent runs of the same view and renders the
+ * result like renderImage does. Every dump is mapped and streamed into a
+ * 64-bit accumulator one at a time, so only one copy of the histogram is
+ * ever held in memory regardless of how many dumps are merged.
+ *
+ * Usage: merge.out [-o image.png] dump1.bin dump2.bin ...
+ */
+
+CheckpointHeader reference;
+vector<uint64_t> sum;
+uint64_t totalSteps = 0;
+
+bool addDump(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+        fprintf(stderr, "%s is not a valid dump\n", filename);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s\n", filename);
+        return false;
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    CheckpointHeader header;
+    memcpy(&header, data, sizeof(CheckpointHeader));
+
+    bool valid = header.magic == DUMP_MAGIC && header.version == CHECKPOINT_VERSION;
+    size_t size = (size_t)header.thresholdCount * header.width * header.height;
+
+    if (!valid || (size_t)st.st_size != sizeof(CheckpointHeader) + size * sizeof(uint32_t)) {
+        fprintf(stderr, "%s is not a valid dump\n", filename);
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    if (sum.empty()) {
+        reference = header;
+        sum.resize(size, 0);
+    } else if (!matchesDump(reference, header)) {
+        fprintf(stderr, "Rejected %s, its view or thresholds don't match the first dump\n", filename);
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    const uint32_t *count = (const uint32_t *)((const char *)data + sizeof(CheckpointHeader));
+
+    for (size_t i = 0; i < size; i++) {
+        sum[i] += count[i];
+    }
+
+    totalSteps += header.stepCount;
+    munmap(data, st.st_size);
+
+    fprintf(stderr, "Added %s, %llu M samples\n", filename, (unsigned long long)(header.stepCount / 1000000LLU));
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    string outName;
+    int merged = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outName = argv[++i];
+        } else {
+            merged += addDump(argv[i]);
+        }
+    }
+
+    if (merged == 0) {
+        fprintf(stderr, "Usage: %s [-o image.png] dump1.bin dump2.bin ...\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t pixelCount = reference.width * reference.height;
+    vector<uint64_t> maximum(reference.thresholdCount);
+
+    for (unsigned int i = 0; i < reference.thresholdCount; i++) {
+        maximum[i] = *max_element(sum.begin() + (size_t)i * pixelCount, sum.begin() + (size_t)(i + 1) * pixelCount);
+    }
+
+    vector<uint32_t> image(3 * pixelCount);
+    renderCounts(sum.data(), maximum.data(), reference.thresholdCount, pixelCount, image.data(), 0, pixelCount);
+
+    if (outName.empty()) {
+        outName = getPngFilename(string(reference.mandelName) + "_merged", reference.view);
+    }
+
+    fprintf(stderr, "Merged %d dumps, %llu M samples\n", merged, (unsigned long long)(totalSteps / 1000000LLU));
+    writePng(outName.c_str(), image.data(), reference.width, reference.height);
+
+    return 0;
+}